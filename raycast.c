@@ -2,30 +2,273 @@
 
 // Writes P3 formatted data to a file
 // Takes in the file handler of the file to be written to
+// Pixels are formatted into a large buffer which is written out whenever it
+// fills up, rather than calling into stdio for every pixel
 void writeP3(FILE* fh) {
-  fprintf(fh, "P%c\n%i %i\n%i\n", format, N, M, maxColor); // Write out header
-  for (int i = 0; i < numPixels; i++) { // Write out Pixel data
-    fprintf(fh, "%i %i %i\n", pixmap[i].R, pixmap[i].G, pixmap[i].B);
+  char header[ppmHeaderSize];
+  fwrite(header, 1, ppm_header(header, '3'), fh); // Write out header
+
+  // decimal text of every channel value, to skip formatting numbers per pixel
+  char digits[maxColor + 1][4];
+  int lengths[maxColor + 1];
+  for (int v = 0; v <= maxColor; v++) {
+    lengths[v] = sprintf(digits[v], "%i", v);
+  }
+
+  char* buffer = malloc(writeBufferSize);
+  int used = 0;
+  for (size_t i = 0; i < numPixels; i++) { // Write out Pixel data
+    if (used > writeBufferSize - 12) { // no room for another "255 255 255\n"
+      fwrite(buffer, 1, used, fh);
+      used = 0;
+    }
+    unsigned char channels[3] = {pixmap[i].R, pixmap[i].G, pixmap[i].B};
+    for (int c = 0; c < 3; c++) {
+      memcpy(&buffer[used], digits[channels[c]], 4);
+      used += lengths[channels[c]];
+      buffer[used++] = (c < 2) ? ' ' : '\n';
+    }
+  }
+  fwrite(buffer, 1, used, fh);
+  free(buffer);
+  fclose(fh);
+}
+
+// Writes P6 formatted data to a file
+// Takes in the file handler of the file to be written to
+// The header and the raw pixmap go out together in a single writev() call
+void writeP6(FILE* fh) {
+  char header[ppmHeaderSize];
+  int headerLength = ppm_header(header, '6');
+  fflush(fh);
+
+  struct iovec parts[2];
+  parts[0].iov_base = header;
+  parts[0].iov_len = headerLength;
+  parts[1].iov_base = pixmap;
+  parts[1].iov_len = numPixels * sizeof(RGBpixel);
+  int part = 0;
+  while (part < 2) { // writev() may stop early on very large images, resume from there
+    ssize_t written = writev(fileno(fh), &parts[part], 2 - part);
+    if (written < 0) {
+      fprintf(stderr, "Error: Could not write the output image.\n");
+      exit(1);
+    }
+    while (part < 2 && (size_t)written >= parts[part].iov_len) {
+      written -= parts[part].iov_len;
+      part++;
+    }
+    if (part < 2) {
+      parts[part].iov_base = (char*)parts[part].iov_base + written;
+      parts[part].iov_len -= written;
+    }
+  }
+  fclose(fh);
+}
+
+// formats the header of the output image into buffer, returning its length
+// The header of a region says where in the frame it belongs, for --merge
+int ppm_header(char* buffer, char magic) {
+  if (useRegion) {
+    return sprintf(buffer, "P%c\n# region %zu %zu %zu %zu of %zu %zu\n%zu %zu\n%i\n", magic,
+      region[0], region[1], region[2], region[3], imageWidth, imageHeight, N, M, maxColor);
+  }
+  return sprintf(buffer, "P%c\n%zu %zu\n%i\n", magic, N, M, maxColor);
+}
+
+// Pick the output format from the extension of the output file name,
+// ".p6" for binary P6 and anything else for the default P3
+char format_from_filename(char* filename) {
+  char* extension = strrchr(filename, '.');
+  if (extension != NULL && strcmp(extension, ".p6") == 0) {
+    return '6';
+  }
+  return format;
+}
+
+// read a P3 or P6 image with a maximum color of 255, storing its size
+// If placement is not NULL it gets the x0, y0, x1, y1, frame width and frame
+// height of a region written with --region, or a frame width of 0
+// Returns the pixels, which the caller frees
+RGBpixel* read_ppm(char* filename, size_t* width, size_t* height, size_t* placement) {
+  FILE* fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+  if (placement != NULL) placement[4] = 0;
+  char magic[3] = {0};
+  size_t header[3]; // width, height, maximum color
+  int ok = fread(magic, 1, 2, fh) == 2 && magic[0] == 'P' && (magic[1] == '3' || magic[1] == '6');
+  for (int i = 0; i < 3 && ok; i++) {
+    int c = fgetc(fh);
+    while (isspace(c) || c == '#') { // whitespace and comments between the fields
+      if (c == '#') {
+        char comment[ppmHeaderSize];
+        size_t length = 0;
+        while ((c = fgetc(fh)) != '\n' && c != EOF) {
+          if (length < sizeof(comment) - 1) comment[length++] = c;
+        }
+        comment[length] = 0;
+        if (placement != NULL && sscanf(comment, " region %zu %zu %zu %zu of %zu %zu", &placement[0],
+            &placement[1], &placement[2], &placement[3], &placement[4], &placement[5]) != 6) {
+          placement[4] = 0; // some other comment
+        }
+      }
+      c = fgetc(fh);
+    }
+    ungetc(c, fh);
+    ok = fscanf(fh, "%zu", &header[i]) == 1;
+  }
+  if (!ok || header[2] != maxColor || header[0] == 0 || header[1] == 0 ||
+      header[1] > SIZE_MAX / header[0] / sizeof(RGBpixel)) {
+    fprintf(stderr, "Error: \"%s\" is not a P3 or P6 image with colors up to %d.\n", filename, maxColor);
+    exit(1);
+  }
+  fgetc(fh); // the single whitespace before the data
+
+  size_t count = header[0] * header[1];
+  RGBpixel* pixels = malloc(count * sizeof(RGBpixel));
+  if (pixels == NULL) {
+    fprintf(stderr, "Error: Not enough memory to read \"%s\".\n", filename);
+    exit(1);
+  }
+  if (magic[1] == '6') {
+    ok = fread(pixels, sizeof(RGBpixel), count, fh) == count;
+  }
+  else {
+    unsigned char* channels = (unsigned char*)pixels;
+    for (size_t i = 0; i < count * 3 && ok; i++) {
+      unsigned value;
+      ok = fscanf(fh, "%u", &value) == 1 && value <= maxColor;
+      channels[i] = value;
+    }
   }
   fclose(fh);
+  if (!ok) {
+    fprintf(stderr, "Error: \"%s\" ends before all of its pixels.\n", filename);
+    exit(1);
+  }
+  *width = header[0];
+  *height = header[1];
+  return pixels;
+}
+
+// compare two images of the same size and print how far apart they are
+// Returns 1 if they differ at all, 0 if they are identical
+int compare_images(char* first, char* second) {
+  size_t width, height, otherWidth, otherHeight;
+  RGBpixel* a = read_ppm(first, &width, &height, NULL);
+  RGBpixel* b = read_ppm(second, &otherWidth, &otherHeight, NULL);
+  if (width != otherWidth || height != otherHeight) {
+    fprintf(stderr, "Error: \"%s\" is %zu by %zu but \"%s\" is %zu by %zu.\n",
+      first, width, height, second, otherWidth, otherHeight);
+    exit(1);
+  }
+
+  size_t count = width * height;
+  size_t differing = 0;
+  int largest = 0;
+  double squares = 0;
+  for (size_t i = 0; i < count; i++) {
+    int d[3] = {a[i].R - b[i].R, a[i].G - b[i].G, a[i].B - b[i].B};
+    if (d[0] != 0 || d[1] != 0 || d[2] != 0) differing++;
+    for (int c = 0; c < 3; c++) {
+      squares += d[c] * d[c];
+      if (abs(d[c]) > largest) largest = abs(d[c]);
+    }
+  }
+  printf("%s vs %s: rms error %.4f, largest error %d, %zu of %zu pixels differ (%.3f%%)\n",
+    first, second, sqrt(squares / (3.0 * count)), largest, differing, count, 100.0 * differing / count);
+  free(a);
+  free(b);
+  return differing != 0;
+}
+
+// put the partial images --region wrote back together into filename
+// The parts may come in any order and may overlap, but must cover the frame
+int merge_regions(char* filename, int numParts, char** parts) {
+  RGBpixel* frame = NULL;
+  unsigned char* covered = NULL; // boolean per pixel of the frame
+  size_t frameWidth = 0;
+  size_t frameHeight = 0;
+  for (int i = 0; i < numParts; i++) {
+    size_t width, height;
+    size_t placement[6];
+    RGBpixel* part = read_ppm(parts[i], &width, &height, placement);
+    if (placement[4] == 0 || placement[0] >= placement[2] || placement[1] >= placement[3] ||
+        placement[2] - placement[0] != width || placement[3] - placement[1] != height ||
+        placement[2] > placement[4] || placement[3] > placement[5]) {
+      fprintf(stderr, "Error: \"%s\" is not a region written by --region.\n", parts[i]);
+      exit(1);
+    }
+    if (frame == NULL) {
+      frameWidth = placement[4];
+      frameHeight = placement[5];
+      if (frameHeight > SIZE_MAX / frameWidth / sizeof(RGBpixel) ||
+          (frame = malloc(frameWidth * frameHeight * sizeof(RGBpixel))) == NULL ||
+          (covered = calloc(frameWidth * frameHeight, 1)) == NULL) {
+        fprintf(stderr, "Error: Not enough memory for a %zu by %zu image.\n", frameWidth, frameHeight);
+        exit(1);
+      }
+    }
+    else if (placement[4] != frameWidth || placement[5] != frameHeight) {
+      fprintf(stderr, "Error: \"%s\" belongs to a %zu by %zu frame, not %zu by %zu.\n",
+        parts[i], placement[4], placement[5], frameWidth, frameHeight);
+      exit(1);
+    }
+    for (size_t y = 0; y < height; y++) {
+      size_t start = (placement[1] + y) * frameWidth + placement[0];
+      memcpy(&frame[start], &part[y * width], width * sizeof(RGBpixel));
+      memset(&covered[start], 1, width);
+    }
+    free(part);
+  }
+
+  for (size_t i = 0; i < frameWidth * frameHeight; i++) {
+    if (!covered[i]) {
+      fprintf(stderr, "Error: No part covers pixel (%zu, %zu) of the frame.\n", i % frameWidth, i / frameWidth);
+      exit(1);
+    }
+  }
+  free(covered);
+
+  pixmap = frame;
+  N = frameWidth;
+  M = frameHeight;
+  numPixels = N * M;
+  FILE* fh = fopen(filename, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+  if (outputFormat == '6') {
+    writeP6(fh);
+  }
+  else {
+    writeP3(fh); // both close fh
+  }
+  free(frame);
+  pixmap = NULL;
+  return 0;
 }
 
 // Calculate if the ray Ro->Rd will intersect with a sphere of center C and radius R
 // Return distance to intersection
-double sphere_intersection(double* Ro, double* Rd, double* C, double r) {
-  double a = sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]);
-  double b = 2 * (Rd[0] * (Ro[0] - C[0]) + Rd[1] * (Ro[1] - C[1]) + Rd[2] * (Ro[2] - C[2]));
-  double c = sqr(Ro[0] - C[0]) + sqr(Ro[1] - C[1]) + sqr(Ro[2] - C[2]) - sqr(r);
+real sphere_intersection(real* Ro, real* Rd, real* C, real r) {
+  real a = sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]);
+  real b = 2 * (Rd[0] * (Ro[0] - C[0]) + Rd[1] * (Ro[1] - C[1]) + Rd[2] * (Ro[2] - C[2]));
+  real c = sqr(Ro[0] - C[0]) + sqr(Ro[1] - C[1]) + sqr(Ro[2] - C[2]) - sqr(r);
 
-  double det = sqr(b) - 4 * a * c;
+  real det = sqr(b) - 4 * a * c;
   if (det < 0) return -1; // no intersection
 
   det = sqrt(det);
 
-  double t0 = (-b - det) / (2 * a);
+  real t0 = (-b - det) / (2 * a);
   if (t0 > 0) return t0;
 
-  double t1 = (-b + det) / (2 * a);
+  real t1 = (-b + det) / (2 * a);
   if (t1 > 0) return t1;
 
   return -1;
@@ -33,9 +276,9 @@ double sphere_intersection(double* Ro, double* Rd, double* C, double r) {
 
 // Calculate if the ray Ro->Rd will intersect with a plane of position P and normal N
 // Return distance to intersection
-double plane_intersection(double* Ro, double* Rd, double* P, double* N) {
-  double D = -(N[0] * P[0] + N[1] * P[1] + N[2] * P[2]); // distance from origin to plane
-  double t = -(N[0] * Ro[0] + N[1] * Ro[1] + N[2] * Ro[2] + D) /
+real plane_intersection(real* Ro, real* Rd, real* P, real* N) {
+  real D = -(N[0] * P[0] + N[1] * P[1] + N[2] * P[2]); // distance from origin to plane
+  real t = -(N[0] * Ro[0] + N[1] * Ro[1] + N[2] * Ro[2] + D) /
   (N[0] * Rd[0] + N[1] * Rd[1] + N[2] * Rd[2]);
 
   if (t > 0) return t;
@@ -43,700 +286,4814 @@ double plane_intersection(double* Ro, double* Rd, double* P, double* N) {
   return -1; // no intersection
 }
 
-// helper function to convert a percentage double into a valid value for a color channel
-unsigned char double_to_color(double color) {
-  if (color > 1.0) {
-    color = 1.0;
-  }
-  else if (color < 0) {
-    color = 0.0;
+// Batched version of sphere_intersection(), one sphere at a time
+// Performs exactly the same operations so every kernel gives identical results
+void sphere_intersection_scalar(real* Ro, real* Rd, SphereArrays* spheres, int first, int count, real* t) {
+  for (int i = 0; i < count; i++) {
+    real C[3] = {spheres->x[first + i], spheres->y[first + i], spheres->z[first + i]};
+    t[i] = sphere_intersection(Ro, Rd, C, spheres->radius[first + i]);
   }
-  return (unsigned char)(maxColor * color);
 }
 
-// Cast the objects in the scene
-void raycast() {
+// Batched version of plane_intersection(), one plane at a time
+void plane_intersection_scalar(real* Ro, real* Rd, PlaneArrays* planes, int first, int count, real* t) {
+  for (int i = 0; i < count; i++) {
+    int p = first + i;
+    real d = -(planes->x[p] * Ro[0] + planes->y[p] * Ro[1] + planes->z[p] * Ro[2] + planes->d[p]) /
+    (planes->x[p] * Rd[0] + planes->y[p] * Rd[1] + planes->z[p] * Rd[2]);
+    t[i] = (d > 0) ? d : -1;
+  }
+}
 
-  // default camera position
-  double cx = cameraObject.position[0];
-  double cy = cameraObject.position[1];
-  double cz = cameraObject.position[2];
+#ifdef X86_KERNELS
+// SSE2 version of sphere_intersection_scalar(), sseLanes spheres per instruction
+void sphere_intersection_sse2(real* Ro, real* Rd, SphereArrays* spheres, int first, int count, real* t) {
+  real a = sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]);
+  sseVec twoA = sse_set1(2 * a);
+  sseVec fourA = sse_set1(4 * a);
+  sseVec two = sse_set1(2);
+  sseVec zero = sse_setzero();
+  sseVec none = sse_set1(-1);
+  sseVec ox = sse_set1(Ro[0]), oy = sse_set1(Ro[1]), oz = sse_set1(Ro[2]);
+  sseVec dx = sse_set1(Rd[0]), dy = sse_set1(Rd[1]), dz = sse_set1(Rd[2]);
 
-  double ch = cameraObject.camera.height;
-  double cw = cameraObject.camera.width;
+  for (int i = 0; i < count; i += sseLanes) {
+    sseVec ex = sse_sub(ox, sse_loadu(&spheres->x[first + i]));
+    sseVec ey = sse_sub(oy, sse_loadu(&spheres->y[first + i]));
+    sseVec ez = sse_sub(oz, sse_loadu(&spheres->z[first + i]));
+    sseVec r = sse_loadu(&spheres->radius[first + i]);
 
-  double pixheight = ch / M;
-  double pixwidth = cw / N;
+    sseVec b = sse_mul(two, sse_add(sse_add(sse_mul(dx, ex), sse_mul(dy, ey)), sse_mul(dz, ez)));
+    sseVec c = sse_sub(sse_add(sse_add(sse_mul(ex, ex), sse_mul(ey, ey)), sse_mul(ez, ez)), sse_mul(r, r));
+    // a negative determinant gives NaN roots, which fail both > 0 tests below
+    sseVec det = sse_sqrt(sse_sub(sse_mul(b, b), sse_mul(fourA, c)));
+    sseVec negB = sse_sub(zero, b);
+    sseVec t0 = sse_div(sse_sub(negB, det), twoA);
+    sseVec t1 = sse_div(sse_add(negB, det), twoA);
 
-  int pixIndex = 0; // position in pixmap array
+    sseVec use0 = sse_cmpgt(t0, zero);
+    sseVec use1 = sse_cmpgt(t1, zero);
+    sseVec result = sse_or(sse_and(use1, t1), sse_andnot(use1, none));
+    result = sse_or(sse_and(use0, t0), sse_andnot(use0, result));
 
-  for (int y = 0; y < M; y++) { // for each row
-    double y_coord = -(cy - (ch/2) + pixheight * (y + 0.5)); // y coord of the row
+    real lanes[sseLanes];
+    sse_storeu(lanes, result);
+    for (int j = 0; j < sseLanes && i + j < count; j++) {
+      t[i + j] = lanes[j];
+    }
+  }
+}
 
-    for (int x = 0; x < N; x++) { // for each column
+// SSE2 version of plane_intersection_scalar(), sseLanes planes per instruction
+void plane_intersection_sse2(real* Ro, real* Rd, PlaneArrays* planes, int first, int count, real* t) {
+  sseVec zero = sse_setzero();
+  sseVec none = sse_set1(-1);
+  sseVec ox = sse_set1(Ro[0]), oy = sse_set1(Ro[1]), oz = sse_set1(Ro[2]);
+  sseVec dx = sse_set1(Rd[0]), dy = sse_set1(Rd[1]), dz = sse_set1(Rd[2]);
 
-      double x_coord = cx - (cw/2) + pixwidth * (x + 0.5); // x coord of the column
-      double Ro[3] = {cx, cy, cz}; // position of camera
-      double Rd[3] = {x_coord, y_coord, 1}; // position of pixel
-      normalize(Rd); // normalize (P - Ro)
+  for (int i = 0; i < count; i += sseLanes) {
+    sseVec nx = sse_loadu(&planes->x[first + i]);
+    sseVec ny = sse_loadu(&planes->y[first + i]);
+    sseVec nz = sse_loadu(&planes->z[first + i]);
+    sseVec d = sse_loadu(&planes->d[first + i]);
+    sseVec num = sse_add(sse_add(sse_add(sse_mul(nx, ox), sse_mul(ny, oy)), sse_mul(nz, oz)), d);
+    sseVec den = sse_add(sse_add(sse_mul(nx, dx), sse_mul(ny, dy)), sse_mul(nz, dz));
+    sseVec dist = sse_div(sse_sub(zero, num), den);
+    sseVec hit = sse_cmpgt(dist, zero);
+    sseVec result = sse_or(sse_and(hit, dist), sse_andnot(hit, none));
 
-      double closestT = INFINITY;
-      Object closestObject;
-      for (int i = 0; i < numPhysicalObjects; i++) { // loop through the array of objects in the scene
-        double t = 0;
-        if (physicalObjects[i].kind == 0) { // plane
-          t = plane_intersection(Ro, Rd, physicalObjects[i].position, physicalObjects[i].plane.normal);
-        }
-        else if (physicalObjects[i].kind == 1) { // sphere
-          t = sphere_intersection(Ro, Rd, physicalObjects[i].position, physicalObjects[i].sphere.radius);
-        }
-        else { // ???
-          fprintf(stderr, "Unrecognized object.\n");
-          exit(1);
-        }
-        if (t > 0 && t < closestT) { // found a closer t value, save the object data
-          printf(""); // memory leak...
-          closestT = t;
-          closestObject = physicalObjects[i];
-        }
-      }
-      // place the pixel into the pixmap array, with illumination
-      if (closestT > 0 && closestT != INFINITY) {
-        illuminate(closestT, closestObject, Rd, Ro, pixIndex);
-      }
-      else { // make background pixels black
-        pixmap[pixIndex].R = 0;
-        pixmap[pixIndex].G = 0;
-        pixmap[pixIndex].B = 0;
-      }
-      pixIndex++;
+    real lanes[sseLanes];
+    sse_storeu(lanes, result);
+    for (int j = 0; j < sseLanes && i + j < count; j++) {
+      t[i + j] = lanes[j];
     }
   }
 }
 
-void illuminate(double colorObjT, Object colorObj, double* Rd, double* Ro, int pixIndex) {
-  // initialize values for color, would be where ambient color goes
-  double color[3];
-
-  color[0] = ambientIntensity * ambience;
-  color[1] = ambientIntensity * ambience;
-  color[2] = ambientIntensity * ambience;
-
-  int kind = colorObj.kind;
+// AVX2 version of sphere_intersection_scalar(), avxLanes spheres per instruction
+__attribute__((target("avx2")))
+void sphere_intersection_avx2(real* Ro, real* Rd, SphereArrays* spheres, int first, int count, real* t) {
+  real a = sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]);
+  avxVec twoA = avx_set1(2 * a);
+  avxVec fourA = avx_set1(4 * a);
+  avxVec two = avx_set1(2);
+  avxVec zero = avx_setzero();
+  avxVec none = avx_set1(-1);
+  avxVec ox = avx_set1(Ro[0]), oy = avx_set1(Ro[1]), oz = avx_set1(Ro[2]);
+  avxVec dx = avx_set1(Rd[0]), dy = avx_set1(Rd[1]), dz = avx_set1(Rd[2]);
 
-  double objOrigin[3]; // where the current object pixel is in space
-  v3_scale(Rd, colorObjT, objOrigin);
-  v3_add(objOrigin, Ro, objOrigin);
+  for (int i = 0; i < count; i += avxLanes) {
+    avxVec ex = avx_sub(ox, avx_loadu(&spheres->x[first + i]));
+    avxVec ey = avx_sub(oy, avx_loadu(&spheres->y[first + i]));
+    avxVec ez = avx_sub(oz, avx_loadu(&spheres->z[first + i]));
+    avxVec r = avx_loadu(&spheres->radius[first + i]);
 
+    avxVec b = avx_mul(two, avx_add(avx_add(avx_mul(dx, ex), avx_mul(dy, ey)), avx_mul(dz, ez)));
+    avxVec c = avx_sub(avx_add(avx_add(avx_mul(ex, ex), avx_mul(ey, ey)), avx_mul(ez, ez)), avx_mul(r, r));
+    // a negative determinant gives NaN roots, which fail both > 0 tests below
+    avxVec det = avx_sqrt(avx_sub(avx_mul(b, b), avx_mul(fourA, c)));
+    avxVec negB = avx_sub(zero, b);
+    avxVec t0 = avx_div(avx_sub(negB, det), twoA);
+    avxVec t1 = avx_div(avx_add(negB, det), twoA);
 
-  double* objToCam = malloc(3 * sizeof(double)); // vector from the object to the camera
-  v3_subtract(cameraObject.position, objOrigin, objToCam);
-  normalize(objToCam);
+    avxVec result = avx_blendv(none, t1, avx_cmp(t1, zero, _CMP_GT_OQ));
+    result = avx_blendv(result, t0, avx_cmp(t0, zero, _CMP_GT_OQ));
 
-  double* surfaceNormal = malloc(3 * sizeof(double));; // surface normal of the object
-  if (kind == 0) { // plane
-    surfaceNormal = colorObj.plane.normal;
-  }
-  else { // sphere
-    v3_subtract(objOrigin, colorObj.position, surfaceNormal);
+    real lanes[avxLanes];
+    avx_storeu(lanes, result);
+    for (int j = 0; j < avxLanes && i + j < count; j++) {
+      t[i + j] = lanes[j];
+    }
   }
-  normalize(surfaceNormal); // TODO: This should really be moved elsewhere to save CPU...
+}
 
-  // loop through all the lights in the lights array
-  for (int i = 0; i < numLightObjects; i++) {
+// AVX2 version of plane_intersection_scalar(), avxLanes planes per instruction
+__attribute__((target("avx2")))
+void plane_intersection_avx2(real* Ro, real* Rd, PlaneArrays* planes, int first, int count, real* t) {
+  avxVec zero = avx_setzero();
+  avxVec none = avx_set1(-1);
+  avxVec ox = avx_set1(Ro[0]), oy = avx_set1(Ro[1]), oz = avx_set1(Ro[2]);
+  avxVec dx = avx_set1(Rd[0]), dy = avx_set1(Rd[1]), dz = avx_set1(Rd[2]);
 
-    double lightToObj[3]; // ray from light towards the object
-    v3_scale(Rd, colorObjT, lightToObj);
-    v3_add(lightToObj, Ro, lightToObj);
-    v3_subtract(lightToObj, lightObjects[i].position, lightToObj);
-    normalize(lightToObj);
+  for (int i = 0; i < count; i += avxLanes) {
+    avxVec nx = avx_loadu(&planes->x[first + i]);
+    avxVec ny = avx_loadu(&planes->y[first + i]);
+    avxVec nz = avx_loadu(&planes->z[first + i]);
+    avxVec d = avx_loadu(&planes->d[first + i]);
+    avxVec num = avx_add(avx_add(avx_add(avx_mul(nx, ox), avx_mul(ny, oy)), avx_mul(nz, oz)), d);
+    avxVec den = avx_add(avx_add(avx_mul(nx, dx), avx_mul(ny, dy)), avx_mul(nz, dz));
+    avxVec dist = avx_div(avx_sub(zero, num), den);
+    avxVec result = avx_blendv(none, dist, avx_cmp(dist, zero, _CMP_GT_OQ));
 
-    double objToLight[3]; // ray from object towards the light
-    v3_subtract(lightObjects[i].position, objOrigin, objToLight);
-    normalize(objToLight);
+    real lanes[avxLanes];
+    avx_storeu(lanes, result);
+    for (int j = 0; j < avxLanes && i + j < count; j++) {
+      t[i + j] = lanes[j];
+    }
+  }
+}
+#endif
 
-    double* lightDirection = lightObjects[i].light.direction;
-    normalize(lightDirection);
+// pick the fastest intersection kernels this CPU supports, or the ones
+// requested with --kernel
+void select_kernels() {
+  sphereKernel = sphere_intersection_scalar;
+  planeKernel = plane_intersection_scalar;
+  char* best = "scalar";
+#ifdef X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    best = "avx2";
+  }
+  else if (__builtin_cpu_supports("sse2")) {
+    best = "sse2";
+  }
+#endif
+  char* wanted = (kernelName != NULL) ? kernelName : best;
 
-    // reflection of the ray of light hitting the surface, symmetrical across the normal
-    double* reflection = malloc(3 * sizeof(double)); // R =  lightToObj - 2 * N * (N dot lightToObj)
-    v3_scale(surfaceNormal, 2  * v3_dot(surfaceNormal, lightToObj), reflection);
-    v3_subtract(lightToObj, reflection, reflection);
-    normalize(reflection);
+  if (strcmp(wanted, "scalar") == 0) {
+    return;
+  }
+#ifdef X86_KERNELS
+  if (strcmp(wanted, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+    sphereKernel = sphere_intersection_sse2;
+    planeKernel = plane_intersection_sse2;
+    return;
+  }
+  if (strcmp(wanted, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    sphereKernel = sphere_intersection_avx2;
+    planeKernel = plane_intersection_avx2;
+    return;
+  }
+#endif
+  fprintf(stderr, "Error: Kernel \"%s\" is not supported on this machine.\n", wanted);
+  exit(1);
+}
 
-    double diffuseFactor = v3_dot(surfaceNormal, objToLight);
-    double specularFactor = v3_dot(reflection, objToCam);
+// microbenchmark of the batched intersection kernels against calling
+// sphere_intersection() and plane_intersection() on each Object in turn
+// Tests random rays against count random spheres and planes and prints the
+// time per ray-primitive test for every kernel this CPU supports
+void bench_kernels(int count) {
+  int numRays = 2000;
+  Object* objects = malloc(count * sizeof(Object)); // spheres
+  Object* flats = malloc(count * sizeof(Object)); // planes
+  real* rays = malloc(numRays * 3 * sizeof(real));
+  real* expected = malloc((count + kernelLanes) * sizeof(real));
+  real* t = malloc((count + kernelLanes) * sizeof(real));
+  SphereArrays spheres = {
+    calloc(count + kernelLanes, sizeof(real)), calloc(count + kernelLanes, sizeof(real)),
+    calloc(count + kernelLanes, sizeof(real)), calloc(count + kernelLanes, sizeof(real))
+  };
+  PlaneArrays planes = {
+    calloc(count + kernelLanes, sizeof(real)), calloc(count + kernelLanes, sizeof(real)),
+    calloc(count + kernelLanes, sizeof(real)), calloc(count + kernelLanes, sizeof(real))
+  };
 
-    double lightDistance = p3_distance(lightObjects[i].position, objOrigin); // distance from the light to the current pixel
+  srand(1);
+  for (int i = 0; i < count; i++) { // spheres in front of the camera, planes facing it
+    memset(&objects[i], 0, sizeof(Object));
+    objects[i].position[0] = spheres.x[i] = 40.0 * rand() / RAND_MAX - 20;
+    objects[i].position[1] = spheres.y[i] = 40.0 * rand() / RAND_MAX - 20;
+    objects[i].position[2] = spheres.z[i] = 40.0 * rand() / RAND_MAX + 20;
+    objects[i].sphere.radius = spheres.radius[i] = 3.0 * rand() / RAND_MAX + 0.5;
+    flats[i] = objects[i];
+    flats[i].kind = 0;
+    flats[i].plane.normal[0] = 1.0 * rand() / RAND_MAX - 0.5;
+    flats[i].plane.normal[1] = 1.0 * rand() / RAND_MAX - 0.5;
+    flats[i].plane.normal[2] = -1;
+    real* N = flats[i].plane.normal;
+    real* P = flats[i].position;
+    planes.x[i] = N[0];
+    planes.y[i] = N[1];
+    planes.z[i] = N[2];
+    planes.d[i] = -(N[0] * P[0] + N[1] * P[1] + N[2] * P[2]);
+  }
+  for (int i = 0; i < numRays; i++) {
+    real* Rd = &rays[3 * i];
+    Rd[0] = 1.0 * rand() / RAND_MAX - 0.5;
+    Rd[1] = 1.0 * rand() / RAND_MAX - 0.5;
+    Rd[2] = 1;
+    normalize(Rd);
+  }
+  real Ro[3] = {0, 0, 0};
 
-    int shadow = 0;
-    double currentT = 0.0;
-    for (int j = 0; j < numPhysicalObjects; j++) { // loop through all the objects in the array
-      Object currentObj = physicalObjects[j];
+  char* names[] = {"scalar", "sse2", "avx2"};
+  for (int shape = 0; shape < 2; shape++) {
+    real baseline = 0.0;
+    volatile real sink = 0.0; // keeps the compiler from dropping the work
 
-      if (obj_compare(currentObj, colorObj)) {
-        continue; // skip over the object we are coloring
+    // the current one object at a time functions
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < numRays; r++) {
+      for (int i = 0; i < count; i++) {
+        if (shape == 0) {
+          sink += sphere_intersection(Ro, &rays[3 * r], objects[i].position, objects[i].sphere.radius);
+        }
+        else {
+          sink += plane_intersection(Ro, &rays[3 * r], flats[i].position, flats[i].plane.normal);
+        }
       }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    baseline = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("%s_intersection (per Object): %.2f ns/test\n", shape == 0 ? "sphere" : "plane",
+      baseline / ((double)numRays * count));
 
-      double* newObjOrigin = malloc(3 * sizeof(double));
-      v3_scale(objToLight, 0.0000001, newObjOrigin);
-      v3_add(newObjOrigin, objOrigin, newObjOrigin);
-
-      if (currentObj.kind == 0) { // plane
-        currentT = plane_intersection(newObjOrigin, objToLight, currentObj.position, currentObj.plane.normal);
-      }
-      else if (currentObj.kind == 1) { // sphere
-        currentT = sphere_intersection(newObjOrigin, objToLight, currentObj.position, currentObj.sphere.radius);
+    for (int k = 0; k < 3; k++) {
+      kernelName = names[k];
+#ifdef X86_KERNELS
+      __builtin_cpu_init();
+      if ((k == 1 && !__builtin_cpu_supports("sse2")) || (k == 2 && !__builtin_cpu_supports("avx2"))) {
+        printf("  %-6s kernel: not supported on this machine\n", names[k]);
+        continue;
       }
-      else { // ???
-        fprintf(stderr, "Unrecognized object.\n");
-        exit(1);
+#else
+      if (k > 0) continue;
+#endif
+      select_kernels();
+
+      int mismatches = 0;
+      for (int r = 0; r < numRays; r++) { // check against the per Object functions first
+        if (shape == 0) sphereKernel(Ro, &rays[3 * r], &spheres, 0, count, t);
+        else planeKernel(Ro, &rays[3 * r], &planes, 0, count, t);
+        for (int i = 0; i < count; i++) {
+          expected[i] = (shape == 0) ?
+            sphere_intersection(Ro, &rays[3 * r], objects[i].position, objects[i].sphere.radius) :
+            plane_intersection(Ro, &rays[3 * r], flats[i].position, flats[i].plane.normal);
+          if (memcmp(&expected[i], &t[i], sizeof(real)) != 0) mismatches++;
+        }
       }
 
-      if (currentT <= lightDistance && currentT > 0 && currentT < INFINITY) {
-        shadow = 1;
-        break;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (int r = 0; r < numRays; r++) {
+        if (shape == 0) sphereKernel(Ro, &rays[3 * r], &spheres, 0, count, t);
+        else planeKernel(Ro, &rays[3 * r], &planes, 0, count, t);
+        sink += t[r % count];
       }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      double elapsed = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+      printf("  %-6s kernel: %.2f ns/test, %.2fx, %d mismatches\n", names[k],
+        elapsed / ((double)numRays * count), baseline / elapsed, mismatches);
     }
-    if (shadow == 0) { // */ // no shadow
-
-      double diffuse[3];
-      diffuse[0] = diffuse_reflection(lightObjects[i].color[0], colorObj.diffuseColor[0], diffuseFactor);
-      diffuse[1] = diffuse_reflection(lightObjects[i].color[1], colorObj.diffuseColor[1], diffuseFactor);
-      diffuse[2] = diffuse_reflection(lightObjects[i].color[2], colorObj.diffuseColor[2], diffuseFactor);
-
-      double specular[3];
-      specular[0] = specular_reflection(lightObjects[i].color[0], colorObj.specularColor[0], diffuseFactor, specularFactor);
-      specular[1] = specular_reflection(lightObjects[i].color[1], colorObj.specularColor[1], diffuseFactor, specularFactor);
-      specular[2] = specular_reflection(lightObjects[i].color[2], colorObj.specularColor[2], diffuseFactor, specularFactor);
+  }
+  kernelName = NULL;
 
-      double fRad = frad(lightDistance, lightObjects[i].light.radialA0, lightObjects[i].light.radialA1, lightObjects[i].light.radialA2);
-      double fAng = fang(lightObjects[i].light.angularA0, lightObjects[i].light.theta, lightToObj, lightDirection);
+  free(objects);
+  free(flats);
+  free(rays);
+  free(expected);
+  free(t);
+  free(spheres.x);
+  free(spheres.y);
+  free(spheres.z);
+  free(spheres.radius);
+  free(planes.x);
+  free(planes.y);
+  free(planes.z);
+  free(planes.d);
+}
 
-      color[0] += fRad * fAng * (diffuse[0] + specular[0]);
-      color[1] += fRad * fAng * (diffuse[1] + specular[1]);
-      color[2] += fRad * fAng * (diffuse[2] + specular[2]);
-    }
+// Calculate if the ray Ro->Rd will intersect with a compiled surface
+// Return distance to intersection
+real surface_intersection(Surface* surface, real* Ro, real* Rd) {
+  if (surface->kind == 0) { // plane, same operations as the plane kernels
+    real* N = surface->normal;
+    real t = -(N[0] * Ro[0] + N[1] * Ro[1] + N[2] * Ro[2] + surface->d) /
+    (N[0] * Rd[0] + N[1] * Rd[1] + N[2] * Rd[2]);
+    return (t > 0) ? t : -1;
   }
-  pixmap[pixIndex].R = double_to_color(color[0]);
-  pixmap[pixIndex].G = double_to_color(color[1]);
-  pixmap[pixIndex].B = double_to_color(color[2]);
+  if (surface->kind == 4) { // mesh, its triangles are tested one at a time
+    return -1;
+  }
+  return sphere_intersection(Ro, Rd, surface->position, surface->radius);
 }
 
-
-// returns 1 if the physical objects are equal, 0 if not
-int obj_compare(Object a, Object b) {
-  if (a.kind == b.kind &&
-    equal(a.diffuseColor[0], b.diffuseColor[0]) &&
-    equal(a.diffuseColor[1], b.diffuseColor[1]) &&
-    equal(a.diffuseColor[2], b.diffuseColor[2]) &&
-    equal(a.specularColor[0], b.specularColor[0]) &&
-    equal(a.specularColor[1], b.specularColor[1]) &&
-    equal(a.specularColor[2], b.specularColor[2]) &&
-    equal(a.position[0], b.position[0]) &&
-    equal(a.position[1], b.position[1]) &&
-    equal(a.position[2], b.position[2])) {
-      if (a.kind == 0 &&
-        equal(a.plane.normal[0], b.plane.normal[0]) &&
-        equal(a.plane.normal[1], b.plane.normal[1]) &&
-        equal(a.plane.normal[2], b.plane.normal[2])) {
-          return 1; // same plane object
-        }
-        else if (a.kind == 1 &&
-          equal(a.sphere.radius, b.sphere.radius)) {
-      return 1; // same sphere object
-    }
+// Calculate if the ray Ro->Rd will intersect with the triangle v0 v1 v2, from
+// either side, with the Moller-Trumbore test
+// Return distance to intersection
+real triangle_intersection(real* Ro, real* Rd, float* v0, float* v1, float* v2) {
+  real edge1[3] = {(real)v1[0] - v0[0], (real)v1[1] - v0[1], (real)v1[2] - v0[2]};
+  real edge2[3] = {(real)v2[0] - v0[0], (real)v2[1] - v0[1], (real)v2[2] - v0[2]};
+  real p[3];
+  v3_cross(Rd, edge2, p);
+  real det = v3_dot(edge1, p);
+  if (det == 0) { // the ray is parallel to the triangle, or it has no area
+    return -1;
   }
-  return 0;
+  real invDet = 1 / det;
+
+  real s[3] = {Ro[0] - v0[0], Ro[1] - v0[1], Ro[2] - v0[2]};
+  real u = v3_dot(s, p) * invDet; // barycentric coordinates of the hit
+  if (u < 0 || u > 1) return -1;
+  real q[3];
+  v3_cross(s, edge1, q);
+  real v = v3_dot(Rd, q) * invDet;
+  if (v < 0 || u + v > 1) return -1;
+
+  real t = v3_dot(edge2, q) * invDet;
+  return (t > 0) ? t : -1;
 }
 
-// calculate diffuse reflection of the object
-double diffuse_reflection(double lightColor, double diffuseColor, double diffuseFactor) {
-  if (diffuseFactor > 0) {
-    return diffuseIntensity * lightColor * diffuseColor * diffuseFactor;
-  }
-  else {
-    return 0.0;
-  }
+// Calculate if the ray Ro->Rd will intersect with triangle i of the scene
+// Return distance to intersection
+real mesh_intersection(Scene* scene, int i, real* Ro, real* Rd) {
+  uint32_t* v = scene->triangles[i].v;
+  return triangle_intersection(Ro, Rd, &scene->vertices[3 * v[0]], &scene->vertices[3 * v[1]], &scene->vertices[3 * v[2]]);
 }
 
-// calculate specular reflection of the object
-double specular_reflection(double lightColor, double specularColor, double diffuseFactor, double specularFactor) {
-  if (specularFactor > 0 && diffuseFactor > 0) {
-    return specularIntensity * lightColor * specularColor * pow(specularFactor, specularPower);
-  }
-  else {
-    return 0.0;
+// Calculate if the ray Ro->Rd will intersect with the surface or triangle
+// named by index, as hits are named in Scene
+// Return distance to intersection
+real primitive_intersection(Scene* scene, int index, real* Ro, real* Rd) {
+  if (index >= scene->numSurfaces) {
+    return mesh_intersection(scene, index - scene->numSurfaces, Ro, Rd);
   }
+  return surface_intersection(&scene->surfaces[index], Ro, Rd);
 }
 
-// helper function to calculate radial attinuation
-double frad(double lightDistance, double a0, double a1, double a2) {
-  if (lightDistance == INFINITY ||
-      (equal(a0, 0.0) && equal(a1, 0.0) && equal(a2, 0.0))) {
-    return 1.0;
-  }
-  else {
-    return 1/(a2 * sqr(lightDistance) + (a1 * lightDistance) + a0);
+// Returns the surface whose material the hit named by index has, the mesh
+// for one of its triangles
+Surface* hit_surface(Scene* scene, int index) {
+  if (index >= scene->numSurfaces) {
+    return &scene->surfaces[scene->triangles[index - scene->numSurfaces].surface];
   }
+  return &scene->surfaces[index];
 }
 
-// helper function to calculate angular attinuation
-double fang(double angularA0, double theta, double* lightToObj, double* lightDirection) { // vl = lightDirection v0 = lightToObj
-  double alpha = rad_to_deg(acos(v3_dot(lightToObj, lightDirection)));
-  if (equal(theta, 0.0)) { // not a spotlight
-    return 1.0;
+// Calculate if the ray Ro->Rd, given by its inverse direction, passes through
+// the box between the distances 0 and maxT
+// Return 1 on a hit and store the distance at which the ray enters the box in tNear
+int ray_box(real* Ro, real* invRd, real* min, real* max, real maxT, real* tNear) {
+  real tmin = 0.0;
+  real tmax = maxT;
+  for (int axis = 0; axis < 3; axis++) {
+    real t0 = (min[axis] - Ro[axis]) * invRd[axis];
+    real t1 = (max[axis] - Ro[axis]) * invRd[axis];
+    if (invRd[axis] < 0) {
+      real swap = t0;
+      t0 = t1;
+      t1 = swap;
+    }
+    // comparisons with the NaN from a ray lying exactly on the slab are false,
+    // so such a slab never shrinks the interval
+    if (t0 > tmin) tmin = t0;
+    if (t1 < tmax) tmax = t1;
   }
-  else if (theta < alpha) { // point isn't within spotlight
-     return 0.0;
+  *tNear = tmin;
+  return tmin <= tmax;
+}
+
+// Find the closest object hit by the ray Ro->Rd
+// Stores the index of the object in hitIndex, -1 if nothing was hit
+// Return distance to intersection
+real nearest_hit(RenderContext* context, real* Ro, real* Rd, int* hitIndex) {
+  Scene* scene = context->scene;
+  RenderStats* stats = &context->stats;
+  real closestT = INFINITY;
+  int closest = -1;
+
+  if (!useBVH) { // test every object in the scene
+    stats->primitiveTests += scene->numSurfaces;
+    for (int i = 0; i < scene->numSurfaces; i++) {
+      real t = surface_intersection(&scene->surfaces[i], Ro, Rd);
+      if (t > 0 && t < closestT) { // found a closer t value, save the object index
+        closestT = t;
+        closest = i;
+      }
+    }
+    stats->primitiveTests += scene->numTriangles;
+    for (int i = 0; i < scene->numTriangles; i++) {
+      real t = mesh_intersection(scene, i, Ro, Rd);
+      if (t > 0 && t < closestT) {
+        closestT = t;
+        closest = scene->numSurfaces + i;
+      }
+    }
+    *hitIndex = closest;
+    return closestT;
   }
-  else {
-    return pow(v3_dot(lightToObj, lightDirection), angularA0);
+
+  // ties go to the lower index, like they do in the linear scan
+  real t[kernelLanes];
+  for (int first = 0; first < scene->numPlanes; first += kernelLanes) {
+    int count = (scene->numPlanes - first < kernelLanes) ? scene->numPlanes - first : kernelLanes;
+    planeKernel(Ro, Rd, &scene->planes, first, count, t);
+    stats->primitiveTests += count;
+    for (int i = 0; i < count; i++) {
+      int index = scene->planeIndices[first + i];
+      if (t[i] > 0 && (t[i] < closestT || (t[i] == closestT && index < closest))) {
+        closestT = t[i];
+        closest = index;
+      }
+    }
   }
-}
 
-// next_c() wraps the getc() function and provides error checking and line
-// number maintenance
-int next_c(FILE* json) {
-  int c = fgetc(json);
-  #ifdef DEBUG
-  printf("next_c: '%c'\n", c);
-  #endif
-  if (c == '\n') {
-    line += 1;
+  if (scene->numBVHNodes > 0) {
+    real invRd[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+    int stack[bvhMaxDepth];
+    real stackT[bvhMaxDepth]; // distance to the box of each node on the stack
+    int top = 0;
+    real tNear;
+    stats->boxTests++;
+    if (ray_box(Ro, invRd, scene->bvhNodes[0].min, scene->bvhNodes[0].max, INFINITY, &tNear)) {
+      stack[top] = 0;
+      stackT[top++] = tNear;
+    }
+
+    while (top > 0) {
+      top--;
+      if (stackT[top] > closestT) continue; // found something closer since it was pushed
+      BVHNode* node = &scene->bvhNodes[stack[top]];
+
+      if (node->count > 0) { // leaf, test the spheres
+        sphereKernel(Ro, Rd, &scene->spheres, node->first, node->count, t);
+        stats->primitiveTests += node->count;
+        for (int i = 0; i < node->count; i++) {
+          int index = scene->bvhIndices[node->first + i];
+          if (t[i] > 0 && (t[i] < closestT || (t[i] == closestT && index < closest))) {
+            closestT = t[i];
+            closest = index;
+          }
+        }
+      }
+      else { // push the children that are hit, nearest on top
+        real tLeft, tRight;
+        stats->boxTests += 2;
+        int hitLeft = ray_box(Ro, invRd, scene->bvhNodes[node->first].min, scene->bvhNodes[node->first].max, closestT, &tLeft);
+        int hitRight = ray_box(Ro, invRd, scene->bvhNodes[node->first + 1].min, scene->bvhNodes[node->first + 1].max, closestT, &tRight);
+        if (hitLeft && hitRight && tLeft < tRight) {
+          stack[top] = node->first + 1;
+          stackT[top++] = tRight;
+          stack[top] = node->first;
+          stackT[top++] = tLeft;
+        }
+        else {
+          if (hitLeft) {
+            stack[top] = node->first;
+            stackT[top++] = tLeft;
+          }
+          if (hitRight) {
+            stack[top] = node->first + 1;
+            stackT[top++] = tRight;
+          }
+        }
+      }
+    }
   }
-  if (c == EOF) {
-    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
-    exit(1);
+
+  if (scene->numMeshNodes > 0) {
+    mesh_nearest_hit(context, Ro, Rd, &closestT, &closest);
   }
-  return c;
+  *hitIndex = closest;
+  return closestT;
 }
 
-// expect_c() checks that the next character is d.  If it is not it emits
-// an error.
-void expect_c(FILE* json, int d) {
-  int c = next_c(json);
-  if (c == d) return;
-  fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
-  exit(1);
+// Test the ray Ro->Rd, given by its inverse direction, against the box of a
+// mesh BVH node, like ray_box()
+int mesh_box(real* Ro, real* invRd, MeshNode* node, real maxT, real* tNear) {
+  real min[3] = {node->min[0], node->min[1], node->min[2]};
+  real max[3] = {node->max[0], node->max[1], node->max[2]};
+  return ray_box(Ro, invRd, min, max, maxT, tNear);
 }
 
-// skip_ws() skips white space in the file.
-void skip_ws(FILE* json) {
-  int c = next_c(json);
-  while (isspace(c)) {
-    c = next_c(json);
+// Find the nearest triangle hit by the ray Ro->Rd closer than closestT, walking
+// the mesh BVH like nearest_hit() walks the sphere BVH
+// Updates closestT and closest when there is one, ties go to the lower index
+void mesh_nearest_hit(RenderContext* context, real* Ro, real* Rd, real* closestT, int* closest) {
+  Scene* scene = context->scene;
+  RenderStats* stats = &context->stats;
+  real invRd[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+  int stack[bvhMaxDepth];
+  real stackT[bvhMaxDepth];
+  int top = 0;
+  real tNear;
+  stats->boxTests++;
+  if (mesh_box(Ro, invRd, &scene->meshNodes[0], *closestT, &tNear)) {
+    stack[top] = 0;
+    stackT[top++] = tNear;
   }
-  ungetc(c, json);
-}
 
-// next_string() gets the next string from the file handle and emits an error
-// if a string can not be obtained.
-char* next_string(FILE* json) {
-  char buffer[129];
-  int c = next_c(json);
-  if (c != '"') {
-    fprintf(stderr, "Error: Expected string on line %d.\n", line);
-    exit(1);
-  }
-  c = next_c(json);
-  int i = 0;
-  while (c != '"') {
-    if (i >= 128) {
-      fprintf(stderr, "Error: Strings longer than 128 characters in length are not supported.\n");
-      exit(1);
-    }
-    if (c == '\\') {
-      fprintf(stderr, "Error: Strings with escape codes are not supported.\n");
-      exit(1);
+  while (top > 0) {
+    top--;
+    if (stackT[top] > *closestT) continue;
+    MeshNode* node = &scene->meshNodes[stack[top]];
+
+    if (node->count > 0) { // leaf, test the triangles
+      stats->primitiveTests += node->count;
+      for (int i = node->first; i < (int)(node->first + node->count); i++) {
+        real t = mesh_intersection(scene, i, Ro, Rd);
+        int index = scene->numSurfaces + i;
+        if (t > 0 && (t < *closestT || (t == *closestT && index < *closest))) {
+          *closestT = t;
+          *closest = index;
+        }
+      }
     }
-    if (c < 32 || c > 126) {
-      fprintf(stderr, "Error: Strings may contain only ascii characters.\n");
-      exit(1);
+    else { // push the children that are hit, nearest on top
+      real tLeft, tRight;
+      stats->boxTests += 2;
+      int hitLeft = mesh_box(Ro, invRd, &scene->meshNodes[node->first], *closestT, &tLeft);
+      int hitRight = mesh_box(Ro, invRd, &scene->meshNodes[node->first + 1], *closestT, &tRight);
+      if (hitLeft && hitRight && tLeft < tRight) {
+        stack[top] = node->first + 1;
+        stackT[top++] = tRight;
+        stack[top] = node->first;
+        stackT[top++] = tLeft;
+      }
+      else {
+        if (hitLeft) {
+          stack[top] = node->first;
+          stackT[top++] = tLeft;
+        }
+        if (hitRight) {
+          stack[top] = node->first + 1;
+          stackT[top++] = tRight;
+        }
+      }
     }
-    buffer[i] = c;
-    i += 1;
-    c = next_c(json);
   }
-  buffer[i] = 0;
-  return strdup(buffer);
 }
 
-// parse the next number in the json file
-double next_number(FILE* json) {
+// Check if the ray Ro->Rd hits any triangle other than the one named by
+// skipIndex before distance maxT, walking the mesh BVH like shadow_hit()
+// Returns the name of the blocking triangle, or -1 if there is none
+int mesh_shadow_hit(RenderContext* context, real* Ro, real* Rd, real maxT, int skipIndex) {
+  Scene* scene = context->scene;
+  RenderStats* stats = &context->stats;
+  real invRd[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+  int stack[bvhMaxDepth];
+  int top = 0;
+  stack[top++] = 0;
+
+  while (top > 0) {
+    MeshNode* node = &scene->meshNodes[stack[--top]];
+    real tNear;
+    stats->boxTests++;
+    if (!mesh_box(Ro, invRd, node, maxT, &tNear)) continue;
+
+    if (node->count > 0) { // leaf, any blocking triangle will do
+      stats->primitiveTests += node->count;
+      for (int i = node->first; i < (int)(node->first + node->count); i++) {
+        int index = scene->numSurfaces + i;
+        if (index == skipIndex) continue;
+        real t = mesh_intersection(scene, i, Ro, Rd);
+        if (t <= maxT && t > 0 && t < INFINITY) {
+          return index;
+        }
+      }
+    }
+    else {
+      stack[top++] = node->first;
+      stack[top++] = node->first + 1;
+    }
+  }
+  return -1;
+}
+
+// Finds the nearest hit of every ray in the packet, walking the BVH once for
+// the whole packet. Returns 0 without tracing when the rays' directions differ
+// in sign on some axis, which the interval test of packet_box() cannot bound.
+// Each ray sees the same nearest hit as nearest_hit() would give it: a node
+// is only entered when one of the rays really hits its box, and every ray
+// that could hit a leaf tests its spheres with the same kernel call.
+int packet_nearest_hit(RenderContext* context, RayPacket* packet) {
+  Scene* scene = context->scene;
+  RenderStats* stats = &context->stats;
+  real* Ro = packet->origin;
+
+  for (int axis = 0; axis < 3; axis++) {
+    real low = INFINITY;
+    real high = -INFINITY;
+    for (int i = 0; i < packet->count; i++) {
+      real inv = 1 / packet->direction[i][axis];
+      packet->invDirection[i][axis] = inv;
+      if (inv < low) low = inv;
+      if (inv > high) high = inv;
+    }
+    if (!(low > 0 || high < 0)) return 0; // the packet straddles this axis
+    packet->invLow[axis] = low;
+    packet->invHigh[axis] = high;
+  }
+
+  // planes are unbounded, each ray tests them on its own
+  real t[kernelLanes];
+  for (int i = 0; i < packet->count; i++) {
+    packet->closestT[i] = INFINITY;
+    packet->closest[i] = -1;
+    for (int first = 0; first < scene->numPlanes; first += kernelLanes) {
+      int count = (scene->numPlanes - first < kernelLanes) ? scene->numPlanes - first : kernelLanes;
+      planeKernel(Ro, packet->direction[i], &scene->planes, first, count, t);
+      stats->primitiveTests += count;
+      for (int j = 0; j < count; j++) {
+        int index = scene->planeIndices[first + j];
+        if (t[j] > 0 && (t[j] < packet->closestT[i] || (t[j] == packet->closestT[i] && index < packet->closest[i]))) {
+          packet->closestT[i] = t[j];
+          packet->closest[i] = index;
+        }
+      }
+    }
+  }
+  if (scene->numBVHNodes == 0) return 1;
+
+  real farthest = -INFINITY; // boxes beyond every ray's nearest hit are skipped
+  for (int i = 0; i < packet->count; i++) {
+    if (packet->closestT[i] > farthest) farthest = packet->closestT[i];
+  }
+
+  int stack[bvhMaxDepth];
+  real stackT[bvhMaxDepth]; // nearest distance any ray of the packet can meet the node's box at
+  int top = 0;
+  real tNear;
+  stats->boxTests++;
+  if (packet_box(packet, scene->bvhNodes[0].min, scene->bvhNodes[0].max, farthest, &tNear)) {
+    stack[top] = 0;
+    stackT[top++] = tNear;
+  }
+
+  while (top > 0) {
+    top--;
+    if (stackT[top] > farthest) continue; // every ray found something closer since it was pushed
+    BVHNode* node = &scene->bvhNodes[stack[top]];
+
+    // the interval test is conservative, find the first ray that really hits the box
+    int firstRay = 0;
+    real tRay;
+    while (firstRay < packet->count) {
+      stats->boxTests++;
+      if (ray_box(Ro, packet->invDirection[firstRay], node->min, node->max, packet->closestT[firstRay], &tRay)) break;
+      firstRay++;
+    }
+    if (firstRay == packet->count) continue;
+
+    if (node->count > 0) { // leaf, the rays before firstRay miss it
+      for (int i = firstRay; i < packet->count; i++) {
+        sphereKernel(Ro, packet->direction[i], &scene->spheres, node->first, node->count, t);
+        stats->primitiveTests += node->count;
+        for (int j = 0; j < node->count; j++) {
+          int index = scene->bvhIndices[node->first + j];
+          if (t[j] > 0 && (t[j] < packet->closestT[i] || (t[j] == packet->closestT[i] && index < packet->closest[i]))) {
+            packet->closestT[i] = t[j];
+            packet->closest[i] = index;
+          }
+        }
+      }
+      farthest = -INFINITY;
+      for (int i = 0; i < packet->count; i++) {
+        if (packet->closestT[i] > farthest) farthest = packet->closestT[i];
+      }
+    }
+    else { // push the children the packet may hit, nearest on top
+      real tLeft, tRight;
+      stats->boxTests += 2;
+      int hitLeft = packet_box(packet, scene->bvhNodes[node->first].min, scene->bvhNodes[node->first].max, farthest, &tLeft);
+      int hitRight = packet_box(packet, scene->bvhNodes[node->first + 1].min, scene->bvhNodes[node->first + 1].max, farthest, &tRight);
+      if (hitLeft && hitRight && tLeft < tRight) {
+        stack[top] = node->first + 1;
+        stackT[top++] = tRight;
+        stack[top] = node->first;
+        stackT[top++] = tLeft;
+      }
+      else {
+        if (hitLeft) {
+          stack[top] = node->first;
+          stackT[top++] = tLeft;
+        }
+        if (hitRight) {
+          stack[top] = node->first + 1;
+          stackT[top++] = tRight;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+// Interval version of ray_box() for a whole packet. Bounds each slab's entry
+// and exit distance over the packet's range of inverse directions, so it never
+// rejects a box that one of the rays hits. Rounding keeps the bounds, as a
+// rounded product never decreases when one of its factors grows.
+int packet_box(RayPacket* packet, real* min, real* max, real maxT, real* tNear) {
+  real tmin = 0.0;
+  real tmax = maxT;
+  for (int axis = 0; axis < 3; axis++) {
+    real low = packet->invLow[axis];
+    real high = packet->invHigh[axis];
+    int negative = high < 0; // every ray of the packet goes the same way on this axis
+    real dNear = (negative ? max[axis] : min[axis]) - packet->origin[axis];
+    real dFar = (negative ? min[axis] : max[axis]) - packet->origin[axis];
+    real t0 = dNear * ((dNear >= 0) ? low : high); // earliest entry of any ray
+    real t1 = dFar * ((dFar >= 0) ? high : low); // latest exit of any ray
+    if (t0 > tmin) tmin = t0;
+    if (t1 < tmax) tmax = t1;
+  }
+  *tNear = tmin;
+  return tmin <= tmax;
+}
+
+// Check if the ray Ro->Rd hits any object other than the one at skipIndex
+// before distance maxT
+// occluder holds the index of the object that blocked the previous shadow ray
+// towards the same light, or -1. Neighboring pixels usually share their
+// shadow caster, so it is tested first and updated whenever another is found.
+// Returns 1 if the ray is blocked, 0 if not
+int shadow_hit(RenderContext* context, real* Ro, real* Rd, real maxT, int skipIndex, int* occluder) {
+  Scene* scene = context->scene;
+  RenderStats* stats = &context->stats;
+  stats->shadowRays++;
+  if (*occluder >= 0 && *occluder != skipIndex) {
+    real t = primitive_intersection(scene, *occluder, Ro, Rd);
+    stats->primitiveTests++;
+    if (t <= maxT && t > 0 && t < INFINITY) {
+      stats->occluderHits++;
+      stats->shadowBlocked++;
+      return 1;
+    }
+  }
+
+  if (!useBVH) { // test every object in the scene
+    for (int i = 0; i < scene->numSurfaces; i++) {
+      if (i == skipIndex) {
+        continue; // skip over the object we are coloring
+      }
+      real t = surface_intersection(&scene->surfaces[i], Ro, Rd);
+      stats->primitiveTests++;
+      if (t <= maxT && t > 0 && t < INFINITY) {
+        *occluder = i;
+        stats->shadowBlocked++;
+        return 1;
+      }
+    }
+    for (int i = 0; i < scene->numTriangles; i++) {
+      if (scene->numSurfaces + i == skipIndex) continue;
+      real t = mesh_intersection(scene, i, Ro, Rd);
+      stats->primitiveTests++;
+      if (t <= maxT && t > 0 && t < INFINITY) {
+        *occluder = scene->numSurfaces + i;
+        stats->shadowBlocked++;
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  real t[kernelLanes];
+  for (int first = 0; first < scene->numPlanes; first += kernelLanes) {
+    int count = (scene->numPlanes - first < kernelLanes) ? scene->numPlanes - first : kernelLanes;
+    planeKernel(Ro, Rd, &scene->planes, first, count, t);
+    stats->primitiveTests += count;
+    for (int i = 0; i < count; i++) {
+      int index = scene->planeIndices[first + i];
+      if (t[i] <= maxT && t[i] > 0 && t[i] < INFINITY && index != skipIndex) {
+        *occluder = index;
+        stats->shadowBlocked++;
+        return 1;
+      }
+    }
+  }
+
+  if (scene->numBVHNodes > 0) {
+    real invRd[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+    int stack[bvhMaxDepth];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0) {
+      BVHNode* node = &scene->bvhNodes[stack[--top]];
+      real tNear;
+      stats->boxTests++;
+      if (!ray_box(Ro, invRd, node->min, node->max, maxT, &tNear)) continue;
+
+      if (node->count > 0) { // leaf, any blocking sphere will do
+        sphereKernel(Ro, Rd, &scene->spheres, node->first, node->count, t);
+        stats->primitiveTests += node->count;
+        for (int i = 0; i < node->count; i++) {
+          int index = scene->bvhIndices[node->first + i];
+          if (t[i] <= maxT && t[i] > 0 && t[i] < INFINITY && index != skipIndex) {
+            *occluder = index;
+            stats->shadowBlocked++;
+            return 1;
+          }
+        }
+      }
+      else {
+        stack[top++] = node->first;
+        stack[top++] = node->first + 1;
+      }
+    }
+  }
+
+  if (scene->numMeshNodes > 0) {
+    int index = mesh_shadow_hit(context, Ro, Rd, maxT, skipIndex);
+    if (index >= 0) {
+      *occluder = index;
+      stats->shadowBlocked++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Supersample the pixels of the image whose neighbors differ from them in
+// the object hit or in color by more than aaThreshold, which catches both
+// silhouettes and shadow borders. Needs the whole image in pixmap and the
+// hitBuffer filled in by the render of it.
+void antialias() {
+  if (aaMask == NULL) {
+    aaMask = malloc(numPixels);
+  }
+  render_tiles(0, M, mark_edges); // decide everything before changing pixels
+  render_tiles(0, M, supersample_tile);
+  aaPixels += numPixels;
+}
+
+// mark the pixels of a tile that need supersampling in aaMask
+void mark_edges(Tile tile, RenderContext* context) {
+  (void)context; // a TileFunction, this pass only reads the image
+  int limit = (int)(aaThreshold * maxColor);
+  for (size_t y = tile.y0; y < tile.y1; y++) {
+    for (size_t x = tile.x0; x < tile.x1; x++) {
+      size_t pixIndex = y * N + x;
+      size_t neighbors[4];
+      int count = 0;
+      if (x > 0) neighbors[count++] = pixIndex - 1;
+      if (x + 1 < N) neighbors[count++] = pixIndex + 1;
+      if (y > 0) neighbors[count++] = pixIndex - N;
+      if (y + 1 < M) neighbors[count++] = pixIndex + N;
+
+      RGBpixel* pixel = &pixmap[pixIndex];
+      int edge = 0;
+      for (int i = 0; i < count && !edge; i++) {
+        RGBpixel* other = &pixmap[neighbors[i]];
+        edge = hitBuffer[neighbors[i]] != hitBuffer[pixIndex] ||
+          abs(pixel->R - other->R) > limit ||
+          abs(pixel->G - other->G) > limit ||
+          abs(pixel->B - other->B) > limit;
+      }
+      aaMask[pixIndex] = edge;
+    }
+  }
+}
+
+// replace each marked pixel of a tile with the average of an aaGrid by
+// aaGrid grid of samples spread evenly across it
+void supersample_tile(Tile tile, RenderContext* context) {
+  #ifdef ALLOC_STATS
+  countAllocations = 1;
+  #endif
+  cull_lights(tile.x0, tile.y0, tile.x1, tile.y1, context);
+  for (size_t y = tile.y0; y < tile.y1; y++) {
+    for (size_t x = tile.x0; x < tile.x1; x++) {
+      size_t pixIndex = y * N + x;
+      if (!aaMask[pixIndex]) continue;
+      real sum[3] = {0, 0, 0};
+      for (int sy = 0; sy < aaGrid; sy++) {
+        for (int sx = 0; sx < aaGrid; sx++) {
+          real color[3];
+          VisiblePoint hit;
+          trace_sample(x + (sx + 0.5) / aaGrid, y + (sy + 0.5) / aaGrid, context, color, &hit);
+          for (int i = 0; i < 3; i++) { // clamp each sample, like a pixel of its own
+            sum[i] += (color[i] > 1.0) ? 1.0 : (color[i] < 0 ? 0.0 : color[i]);
+          }
+        }
+      }
+      pixmap[pixIndex].R = double_to_color(sum[0] / (aaGrid * aaGrid));
+      pixmap[pixIndex].G = double_to_color(sum[1] / (aaGrid * aaGrid));
+      pixmap[pixIndex].B = double_to_color(sum[2] / (aaGrid * aaGrid));
+      context->stats.refinedPixels++;
+    }
+  }
+  #ifdef ALLOC_STATS
+  countAllocations = 0;
+  #endif
+}
+
+// print how many pixels antialias() refined and what it cost in rays
+void report_antialiasing() {
+  printf("Antialiasing refined %zu of %zu pixels (%.1f%%), %.2f primary rays per pixel\n",
+    renderStats.refinedPixels, aaPixels, 100.0 * renderStats.refinedPixels / aaPixels,
+    (double)(aaPixels + renderStats.refinedPixels * aaGrid * aaGrid) / aaPixels);
+}
+
+// helper function to convert a percentage into a valid value for a color channel
+unsigned char double_to_color(real color) {
+  if (color > 1.0) {
+    color = 1.0;
+  }
+  else if (color < 0) {
+    color = 0.0;
+  }
+  return (unsigned char)(maxColor * color);
+}
+
+// Cast the objects in the scene
+void raycast() {
+  raycast_band(0, M);
+}
+
+// Cast the rows [firstRow, endRow) of the image, pixmap holds row firstRow onwards
+void raycast_band(size_t firstRow, size_t endRow) {
+  render_tiles(firstRow, endRow, raycast_tile);
+}
+
+// Run function over the rows [firstRow, endRow) of the image, pixmap holds
+// row firstRow onwards
+// The rows are split into tiles which are handed out to numThreads render
+// threads. Every pixel is computed the same way no matter which thread renders
+// it, so the output matches the single threaded image exactly.
+void render_tiles(size_t firstRow, size_t endRow, TileFunction function) {
+  pixmapFirstRow = firstRow;
+  tileFunction = function;
+  if (numThreads <= 1) { // render the whole band on this thread
+    Tile band = {0, firstRow, N, endRow};
+    RenderContext context;
+    init_context(&context, &compiledScene);
+    function(band, &context);
+    free_context(&context);
+    return;
+  }
+
+  // split the band into tiles
+  size_t tilesX = (N + tileSize - 1) / tileSize;
+  size_t tilesY = (endRow - firstRow + tileSize - 1) / tileSize;
+  numTiles = tilesX * tilesY;
+  if (numTiles > tileCapacity) { // kept between calls, bands and frames reuse it
+    free(tiles);
+    tiles = malloc(numTiles * sizeof(Tile));
+    tileCapacity = numTiles;
+  }
+  for (size_t ty = 0; ty < tilesY; ty++) {
+    for (size_t tx = 0; tx < tilesX; tx++) {
+      Tile* tile = &tiles[ty * tilesX + tx];
+      tile->x0 = tx * tileSize;
+      tile->y0 = firstRow + ty * tileSize;
+      tile->x1 = (tile->x0 + tileSize < N) ? tile->x0 + tileSize : N;
+      tile->y1 = (tile->y0 + tileSize < endRow) ? tile->y0 + tileSize : endRow;
+    }
+  }
+
+  // deal out an even share of consecutive tiles to each thread's queue
+  if (tileQueues == NULL) {
+    tileQueues = malloc(numThreads * sizeof(TileQueue));
+    for (int i = 0; i < numThreads; i++) {
+      pthread_mutex_init(&tileQueues[i].lock, NULL);
+    }
+  }
+  for (int i = 0; i < numThreads; i++) {
+    tileQueues[i].head = numTiles * i / numThreads;
+    tileQueues[i].tail = numTiles * (i + 1) / numThreads;
+  }
+
+  // wake the render threads and wait for them to finish the batch
+  if (poolThreads == NULL) start_pool();
+  pthread_mutex_lock(&poolLock);
+  poolRunning = numThreads;
+  poolBatch++;
+  pthread_cond_broadcast(&poolStart);
+  while (poolRunning > 0) {
+    pthread_cond_wait(&poolDone, &poolLock);
+  }
+  pthread_mutex_unlock(&poolLock);
+}
+
+// Start the render threads, which live until stop_pool() so that bands,
+// passes, frames and daemon jobs do not pay for creating them every time
+void start_pool() {
+  poolThreads = malloc(numThreads * sizeof(pthread_t));
+  poolIds = malloc(numThreads * sizeof(int));
+  for (int i = 0; i < numThreads; i++) {
+    poolIds[i] = i;
+    if (pthread_create(&poolThreads[i], NULL, render_worker, &poolIds[i]) != 0) {
+      fprintf(stderr, "Error: Could not create render thread %d.\n", i);
+      exit(1);
+    }
+  }
+}
+
+// Tell the render threads to return and wait for them
+void stop_pool() {
+  if (poolThreads == NULL) return;
+  pthread_mutex_lock(&poolLock);
+  poolExit = 1;
+  pthread_cond_broadcast(&poolStart);
+  pthread_mutex_unlock(&poolLock);
+  for (int i = 0; i < numThreads; i++) {
+    pthread_join(poolThreads[i], NULL);
+  }
+  free(poolThreads);
+  free(poolIds);
+  poolThreads = NULL;
+}
+
+// Render thread, waits for render_tiles() to hand out a batch of tiles and
+// renders tiles until every queue is empty, then waits for the next batch
+void* render_worker(void* arg) {
+  int worker = *(int*)arg;
+  unsigned long batch = 0; // last batch this thread worked on
+  pthread_mutex_lock(&poolLock);
+  while (1) {
+    while (poolBatch == batch && !poolExit) {
+      pthread_cond_wait(&poolStart, &poolLock);
+    }
+    if (poolExit) break;
+    batch = poolBatch;
+    pthread_mutex_unlock(&poolLock);
+
+    RenderContext context; // the scene may differ between batches
+    init_context(&context, &compiledScene);
+    size_t tile;
+    while (next_tile(worker, &tile)) {
+      tileFunction(tiles[tile], &context);
+    }
+    free_context(&context);
+
+    pthread_mutex_lock(&poolLock);
+    if (--poolRunning == 0) pthread_cond_signal(&poolDone);
+  }
+  pthread_mutex_unlock(&poolLock);
+  return NULL;
+}
+
+// set up the per thread state of a render thread
+void init_context(RenderContext* context, Scene* scene) {
+  context->scene = scene;
+  context->lastOccluder = malloc((scene->numLights + 1) * sizeof(int));
+  for (int i = 0; i < scene->numLights; i++) {
+    context->lastOccluder[i] = -1; // nothing has cast a shadow yet
+  }
+  context->tileLights = malloc((scene->numLights + 1) * sizeof(int));
+  for (int i = 0; i < scene->numLights; i++) {
+    context->tileLights[i] = i; // every light, until cull_lights() is given a tile
+  }
+  context->numTileLights = scene->numLights;
+  context->lightRuns = malloc((scene->numLights + 1) * sizeof(int));
+  group_lights(context);
+  memset(&context->stats, 0, sizeof(RenderStats));
+}
+
+// free the per thread state of a render thread, adding its counters to
+// renderStats
+void free_context(RenderContext* context) {
+  free(context->lastOccluder);
+  free(context->tileLights);
+  free(context->lightRuns);
+  RenderStats* stats = &context->stats;
+  pthread_mutex_lock(&statsLock);
+  renderStats.primaryRays += stats->primaryRays;
+  renderStats.shadowRays += stats->shadowRays;
+  renderStats.shadowBlocked += stats->shadowBlocked;
+  renderStats.occluderHits += stats->occluderHits;
+  renderStats.primitiveTests += stats->primitiveTests;
+  renderStats.boxTests += stats->boxTests;
+  renderStats.litPixels += stats->litPixels;
+  renderStats.backgroundPixels += stats->backgroundPixels;
+  renderStats.refinedPixels += stats->refinedPixels;
+  renderStats.packets += stats->packets;
+  renderStats.splitPackets += stats->splitPackets;
+  renderStats.culledLights += stats->culledLights;
+  pthread_mutex_unlock(&statsLock);
+}
+
+// Get the next tile for a render thread to work on and store it in tile
+// Takes from the head of the thread's own queue, or steals from the tail of
+// another thread's queue once its own is empty. Returns 0 when all are empty.
+int next_tile(int worker, size_t* tile) {
+  for (int i = 0; i < numThreads; i++) {
+    int victim = (worker + i) % numThreads;
+    TileQueue* queue = &tileQueues[victim];
+    int found = 0;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail) {
+      if (victim == worker) {
+        *tile = queue->head++;
+      }
+      else {
+        *tile = --queue->tail;
+      }
+      found = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (found) return 1;
+  }
+  return 0;
+}
+
+// Cast the rays for every pixel inside of a tile, storing them in pixmap
+void raycast_tile(Tile tile, RenderContext* context) {
+  #ifdef ALLOC_STATS
+  countAllocations = 1; // the per pixel path must not allocate
+  #endif
+  cull_lights(tile.x0, tile.y0, tile.x1, tile.y1, context);
+
+  // only the pixels on the lattice of the current pass, 1 outside of progressive renders
+  size_t firstX = (tile.x0 + passStep - 1) / passStep * passStep;
+  size_t firstY = (tile.y0 + passStep - 1) / passStep * passStep;
+
+  if (packetSize > 0 && useBVH) { // blocks of packetSize by packetSize lattice points
+    size_t blockStep = packetSize * passStep;
+    RayPacket packet;
+    for (size_t blockY = firstY; blockY < tile.y1; blockY += blockStep) {
+      for (size_t blockX = firstX; blockX < tile.x1; blockX += blockStep) {
+        packet.count = 0;
+        for (size_t y = blockY; y < blockY + blockStep && y < tile.y1; y += passStep) {
+          int skipRow = tracedStep != 0 && y % tracedStep == 0;
+          for (size_t x = blockX; x < blockX + blockStep && x < tile.x1; x += passStep) {
+            if (skipRow && x % tracedStep == 0) continue;
+            primary_ray(context->scene, x + 0.5, y + 0.5, packet.origin, packet.direction[packet.count]);
+            packet.pixIndex[packet.count++] = (y - pixmapFirstRow) * N + x;
+          }
+        }
+        if (packet.count > 0) trace_packet(&packet, context);
+      }
+    }
+  }
+  else {
+    for (size_t y = firstY; y < tile.y1; y += passStep) { // for each row
+      int skipRow = tracedStep != 0 && y % tracedStep == 0; // holds pixels an earlier pass traced
+
+      for (size_t x = firstX; x < tile.x1; x += passStep) { // for each column
+        if (skipRow && x % tracedStep == 0) continue; // never trace a pixel twice
+        real color[3];
+        VisiblePoint hit;
+        int closestIndex = trace_sample(x + 0.5, y + 0.5, context, color, &hit); // through the pixel center
+        store_pixel((y - pixmapFirstRow) * N + x, color, closestIndex, &hit, context);
+      }
+    }
+  }
+  #ifdef ALLOC_STATS
+  countAllocations = 0;
+  #endif
+}
+
+// Writes the color of a traced pixel, recording what its center ray hit
+void store_pixel(size_t pixIndex, real* color, int index, VisiblePoint* hit, RenderContext* context) {
+  pixmap[pixIndex].R = double_to_color(color[0]);
+  pixmap[pixIndex].G = double_to_color(color[1]);
+  pixmap[pixIndex].B = double_to_color(color[2]);
+  if (hitBuffer != NULL) hitBuffer[pixIndex] = index;
+  if (visibility != NULL && index >= 0) visibility[pixIndex] = *hit;
+  if (index >= 0) context->stats.litPixels++;
+  else context->stats.backgroundPixels++;
+}
+
+// Trace the ray from the camera through the point (px, py) of the image,
+// measured in pixels from its top left corner, and store its color in color
+// Returns the index of the object hit, or -1 for the black background, and
+// stores the point hit and its normal in hit
+int trace_sample(real px, real py, RenderContext* context, real* color, VisiblePoint* hit) {
+  real Ro[3];
+  real Rd[3];
+  primary_ray(context->scene, px, py, Ro, Rd);
+
+  int closestIndex;
+  real closestT = nearest_hit(context, Ro, Rd, &closestIndex);
+  context->stats.primaryRays++;
+  shade_hit(closestT, closestIndex, Ro, Rd, context, color, hit);
+  return closestIndex;
+}
+
+// Stores in Ro and Rd the ray from the camera through image point (px, py)
+void primary_ray(Scene* scene, real px, real py, real* Ro, real* Rd) {
+  // default camera position
+  real cx = scene->cameraPosition[0];
+  real cy = scene->cameraPosition[1];
+  real cz = scene->cameraPosition[2];
+
+  real ch = scene->cameraHeight;
+  real cw = scene->cameraWidth;
+
+  real pixheight = ch / imageHeight;
+  real pixwidth = cw / imageWidth;
+  px += bufferLeft; // position in the whole frame, when rendering a region
+  py += bufferTop;
+
+  real y_coord = -(cy - (ch/2) + pixheight * py); // y coord of the point
+  real x_coord = cx - (cw/2) + pixwidth * px; // x coord of the point
+  Ro[0] = cx; // position of camera
+  Ro[1] = cy;
+  Ro[2] = cz;
+  Rd[0] = x_coord; // position of pixel
+  Rd[1] = y_coord;
+  Rd[2] = 1;
+  normalize(Rd); // normalize (P - Ro)
+}
+
+// Stores in color the shade of the nearest hit of a primary ray, black when it
+// hit nothing, and in hit the point hit and its normal
+void shade_hit(real t, int index, real* Ro, real* Rd, RenderContext* context, real* color, VisiblePoint* hit) {
+  if (index >= 0) { // with illumination
+    surface_point(context->scene, t, index, Ro, Rd, hit->position, hit->normal);
+    illuminate(index, hit->position, hit->normal, color, context);
+  }
+  else { // make background pixels black
+    color[0] = 0;
+    color[1] = 0;
+    color[2] = 0;
+  }
+}
+
+// Traces the primary rays of a packet and stores their pixels
+void trace_packet(RayPacket* packet, RenderContext* context) {
+  context->stats.primaryRays += packet->count;
+  if (packet_nearest_hit(context, packet)) {
+    context->stats.packets++;
+    if (context->scene->numMeshNodes > 0) { // the packet walks the sphere BVH only
+      for (int i = 0; i < packet->count; i++) {
+        mesh_nearest_hit(context, packet->origin, packet->direction[i], &packet->closestT[i], &packet->closest[i]);
+      }
+    }
+  }
+  else { // the directions diverge, trace the rays one at a time
+    context->stats.splitPackets++;
+    for (int i = 0; i < packet->count; i++) {
+      packet->closestT[i] = nearest_hit(context, packet->origin, packet->direction[i], &packet->closest[i]);
+    }
+  }
+  for (int i = 0; i < packet->count; i++) {
+    real color[3];
+    VisiblePoint hit;
+    shade_hit(packet->closestT[i], packet->closest[i], packet->origin, packet->direction[i], context, color, &hit);
+    store_pixel(packet->pixIndex[i], color, packet->closest[i], &hit, context);
+  }
+}
+
+// Stores in scene->lightRadii how far each light reaches before the most it
+// can add to a channel of any point drops below its share of lightCutoff
+// color levels. The cutoff is split evenly between the lights that can be
+// bounded, so all the light skipped at any point adds up to less than
+// lightCutoff levels. diffuse_reflection() plus specular_reflection() is at
+// most the light's color times the brightest diffuse plus specular color of
+// any surface, and fang() is at most 1, so frad() alone decides the reach.
+// Lights without a falloff, or with coefficients that are not all non
+// negative, reach everywhere.
+void bound_lights(Scene* scene) {
+  free(scene->lightRadii);
+  scene->lightRadii = malloc((scene->numLights + 1) * sizeof(real));
+
+  real brightest = 0; // largest diffuse plus specular channel of any surface
+  for (int i = 0; i < scene->numSurfaces; i++) {
+    for (int c = 0; c < 3; c++) {
+      real channel = scene->surfaces[i].diffuseColor[c] + scene->surfaces[i].specularColor[c];
+      if (channel > brightest) brightest = channel;
+    }
+  }
+
+  int numBounded = 0;
+  for (int i = 0; i < scene->numLights; i++) {
+    numBounded += light_bounded(&scene->lights[i]);
+  }
+  real share = (numBounded > 0) ? lightCutoff / numBounded : 0; // color levels each light may skip
+
+  for (int i = 0; i < scene->numLights; i++) {
+    Light* light = &scene->lights[i];
+    real a0 = light->radialA0;
+    real a1 = light->radialA1;
+    real a2 = light->radialA2;
+    real radius = INFINITY;
+    if (share > 0 && light_bounded(light)) {
+      real strongest = light->color[0];
+      if (light->color[1] > strongest) strongest = light->color[1];
+      if (light->color[2] > strongest) strongest = light->color[2];
+      // frad() denominator past which the light adds less than the cutoff
+      real limit = strongest * brightest / (share / maxColor);
+      if (a0 >= limit) {
+        radius = 0; // never bright enough to see
+      }
+      else if (a2 > 0) { // positive root of a2 d^2 + a1 d + a0 = limit
+        radius = (-a1 + sqrt(a1 * a1 + 4 * a2 * (limit - a0))) / (2 * a2);
+      }
+      else if (a1 > 0) {
+        radius = (limit - a0) / a1;
+      }
+    }
+    scene->lightRadii[i] = radius;
+  }
+}
+
+// Returns 1 if the reach of light can be bounded by bound_lights(), when its
+// falloff grows with distance and never turns negative
+int light_bounded(Light* light) {
+  return (light->lightClass & lightAttenuated) &&
+    light->radialA0 >= 0 && light->radialA1 >= 0 && light->radialA2 >= 0 &&
+    (!(light->lightClass & lightSpot) || light->angularA0 >= 0);
+}
+
+// Stores in context->tileLights the lights whose reach touches the part of
+// the scene seen through the image rectangle from (x0, y0) to (x1, y1).
+// Everything a primary ray through the rectangle hits lies inside the four
+// planes through the camera and its edges, so a light further than its
+// radius outside one of them can not light any point illuminate() shades.
+void cull_lights(real x0, real y0, real x1, real y1, RenderContext* context) {
+  Scene* scene = context->scene;
+  real Ro[3];
+  real corners[4][3];
+  real center[3];
+  primary_ray(scene, x0, y0, Ro, corners[0]);
+  primary_ray(scene, x1, y0, Ro, corners[1]);
+  primary_ray(scene, x1, y1, Ro, corners[2]);
+  primary_ray(scene, x0, y1, Ro, corners[3]);
+  primary_ray(scene, (x0 + x1) / 2, (y0 + y1) / 2, Ro, center);
+
+  real sides[4][3]; // unit normals of the edge planes, pointing into the tile
+  for (int side = 0; side < 4; side++) {
+    v3_cross(corners[side], corners[(side + 1) % 4], sides[side]);
+    if (v3_dot(sides[side], center) < 0) v3_scale(sides[side], -1, sides[side]);
+    normalize(sides[side]);
+  }
+
+  context->numTileLights = 0;
+  for (int i = 0; i < scene->numLights; i++) {
+    real radius = scene->lightRadii[i];
+    int reaches = 1;
+    if (radius < INFINITY) {
+      real toLight[3];
+      v3_subtract(scene->lights[i].position, Ro, toLight);
+      // hit points are rounded, by an amount growing with their distance from the camera
+      real margin = radius + cullMargin * (sqrt(v3_dot(toLight, toLight)) + radius);
+      for (int side = 0; side < 4 && reaches; side++) {
+        if (v3_dot(sides[side], toLight) < -margin) reaches = 0;
+      }
+    }
+    if (reaches) context->tileLights[context->numTileLights++] = i;
+  }
+  group_lights(context);
+}
+
+// Stores in objOrigin the point at distance colorObjT along Ro->Rd, on
+// surface or triangle colorIndex, and in surfaceNormal the unit normal there
+void surface_point(Scene* scene, real colorObjT, int colorIndex, real* Ro, real* Rd, real* objOrigin, real* surfaceNormal) {
+  v3_scale(Rd, colorObjT, objOrigin);
+  v3_add(objOrigin, Ro, objOrigin);
+
+  if (colorIndex >= scene->numSurfaces) { // triangle, its normal faces the ray
+    uint32_t* v = scene->triangles[colorIndex - scene->numSurfaces].v;
+    float* v0 = &scene->vertices[3 * v[0]];
+    float* v1 = &scene->vertices[3 * v[1]];
+    float* v2 = &scene->vertices[3 * v[2]];
+    real edge1[3] = {(real)v1[0] - v0[0], (real)v1[1] - v0[1], (real)v1[2] - v0[2]};
+    real edge2[3] = {(real)v2[0] - v0[0], (real)v2[1] - v0[1], (real)v2[2] - v0[2]};
+    v3_cross(edge1, edge2, surfaceNormal);
+    normalize(surfaceNormal);
+    if (v3_dot(surfaceNormal, Rd) > 0) {
+      v3_scale(surfaceNormal, -1, surfaceNormal);
+    }
+    return;
+  }
+
+  Surface* surface = &scene->surfaces[colorIndex];
+  if (surface->kind == 0) { // plane, already unit length
+    memcpy(surfaceNormal, surface->normal, 3 * sizeof(real));
+  }
+  else { // sphere
+    v3_subtract(objOrigin, surface->position, surfaceNormal);
+    normalize(surfaceNormal);
+  }
+}
+
+// Stores in color the light reaching the eye from point objOrigin of
+// surface colorIndex, whose unit normal is surfaceNormal
+void illuminate(int colorIndex, real* objOrigin, real* surfaceNormal, real* color, RenderContext* context) {
+  Scene* scene = context->scene;
+
+  // initialize values for color, would be where ambient color goes
+  color[0] = ambientIntensity * ambience;
+  color[1] = ambientIntensity * ambience;
+  color[2] = ambientIntensity * ambience;
+
+  real objToCam[3]; // vector from the object to the camera
+  v3_subtract(scene->cameraPosition, objOrigin, objToCam);
+  normalize(objToCam);
+
+  // the lights that can reach this tile, each run of one class by its own kernel
+  context->stats.culledLights += scene->numLights - context->numTileLights;
+  int first = 0;
+  for (int run = 0; run < context->numLightRuns; run++) {
+    int end = context->lightRuns[run];
+    switch (scene->lights[context->tileLights[first]].lightClass) {
+      case 0:
+        shade_point_lights(first, end, colorIndex, objOrigin, surfaceNormal, objToCam, color, context);
+        break;
+      case lightAttenuated:
+        shade_attenuated_lights(first, end, colorIndex, objOrigin, surfaceNormal, objToCam, color, context);
+        break;
+      case lightSpot:
+        shade_spot_lights(first, end, colorIndex, objOrigin, surfaceNormal, objToCam, color, context);
+        break;
+      default:
+        shade_attenuated_spot_lights(first, end, colorIndex, objOrigin, surfaceNormal, objToCam, color, context);
+    }
+    first = end;
+  }
+}
+
+// Add to color the light that context->tileLights[first, end) give point
+// objOrigin of surface colorIndex. Every one of those lights is of class
+// lightClass, which the kernels below pass as a constant, so each inlined
+// copy drops the falloff and cone tests its class does not need and its
+// loop never branches on the class. The lights are shaded in the order
+// illuminate() always used, so the sums and the image are unchanged.
+static inline __attribute__((always_inline))
+void shade_lights(int first, int end, int lightClass, int colorIndex, real* objOrigin, real* surfaceNormal,
+                  real* objToCam, real* color, RenderContext* context) {
+  Scene* scene = context->scene;
+  Surface* surface = hit_surface(scene, colorIndex);
+  for (int tileLight = first; tileLight < end; tileLight++) {
+    int i = context->tileLights[tileLight];
+    Light* light = &scene->lights[i];
+
+    real lightToObj[3]; // ray from light towards the object
+    v3_subtract(objOrigin, light->position, lightToObj);
+    normalize(lightToObj);
+
+    real lightDistance = p3_distance(light->position, objOrigin); // distance from the light to the current pixel
+
+    // skip the shadow ray of lights that can not change the color, too far
+    // away to be seen or with the point outside their cone, where fang() is 0
+    if (lightDistance >= scene->lightRadii[i] ||
+        ((lightClass & lightSpot) && v3_dot(lightToObj, light->direction) < light->cosTheta)) {
+      context->stats.culledLights++;
+      continue;
+    }
+
+    real objToLight[3]; // ray from object towards the light
+    v3_subtract(light->position, objOrigin, objToLight);
+    normalize(objToLight);
+
+    // reflection of the ray of light hitting the surface, symmetrical across the normal
+    real reflection[3]; // R =  lightToObj - 2 * N * (N dot lightToObj)
+    v3_scale(surfaceNormal, 2  * v3_dot(surfaceNormal, lightToObj), reflection);
+    v3_subtract(lightToObj, reflection, reflection);
+    normalize(reflection);
+
+    real diffuseFactor = v3_dot(surfaceNormal, objToLight);
+    real specularFactor = v3_dot(reflection, objToCam);
+
+    real newObjOrigin[3]; // just off the surface, so the shadow ray does not hit it
+    v3_scale(objToLight, shadowBias, newObjOrigin);
+    v3_add(newObjOrigin, objOrigin, newObjOrigin);
+
+    int shadow = shadow_hit(context, newObjOrigin, objToLight, lightDistance, colorIndex, &context->lastOccluder[i]);
+    if (shadow == 0) { // */ // no shadow
+
+      real diffuse[3];
+      diffuse[0] = diffuse_reflection(light->color[0], surface->diffuseColor[0], diffuseFactor);
+      diffuse[1] = diffuse_reflection(light->color[1], surface->diffuseColor[1], diffuseFactor);
+      diffuse[2] = diffuse_reflection(light->color[2], surface->diffuseColor[2], diffuseFactor);
+
+      real specular[3];
+      specular[0] = specular_reflection(light->color[0], surface->specularColor[0], diffuseFactor, specularFactor);
+      specular[1] = specular_reflection(light->color[1], surface->specularColor[1], diffuseFactor, specularFactor);
+      specular[2] = specular_reflection(light->color[2], surface->specularColor[2], diffuseFactor, specularFactor);
+
+      real fRad = 1.0;
+      if (lightClass & lightAttenuated) {
+        fRad = frad(lightDistance, light->radialA0, light->radialA1, light->radialA2);
+      }
+      real fAng = 1.0;
+      if (lightClass & lightSpot) {
+        fAng = fang(light->angularA0, light->cosTheta, lightToObj, light->direction);
+      }
+
+      color[0] += fRad * fAng * (diffuse[0] + specular[0]);
+      color[1] += fRad * fAng * (diffuse[1] + specular[1]);
+      color[2] += fRad * fAng * (diffuse[2] + specular[2]);
+    }
+  }
+}
+
+// Defines name(), the shading kernel for lights of class lightClass
+#define SHADE_KERNEL(name, lightClass) \
+  void name(int first, int end, int colorIndex, real* objOrigin, real* surfaceNormal, real* objToCam, \
+            real* color, RenderContext* context) { \
+    shade_lights(first, end, lightClass, colorIndex, objOrigin, surfaceNormal, objToCam, color, context); \
+  }
+
+SHADE_KERNEL(shade_point_lights, 0)
+SHADE_KERNEL(shade_attenuated_lights, lightAttenuated)
+SHADE_KERNEL(shade_spot_lights, lightSpot)
+SHADE_KERNEL(shade_attenuated_spot_lights, lightAttenuated | lightSpot)
+
+// Split context->tileLights into runs of consecutive lights of one class,
+// storing where each run ends in context->lightRuns
+void group_lights(RenderContext* context) {
+  Light* lights = context->scene->lights;
+  context->numLightRuns = 0;
+  for (int i = 0; i < context->numTileLights; i++) {
+    if (i + 1 == context->numTileLights ||
+        lights[context->tileLights[i]].lightClass != lights[context->tileLights[i + 1]].lightClass) {
+      context->lightRuns[context->numLightRuns++] = i + 1;
+    }
+  }
+}
+
+// calculate diffuse reflection of the object
+real diffuse_reflection(real lightColor, real diffuseColor, real diffuseFactor) {
+  if (diffuseFactor > 0) {
+    return diffuseIntensity * lightColor * diffuseColor * diffuseFactor;
+  }
+  else {
+    return 0.0;
+  }
+}
+
+// calculate specular reflection of the object
+real specular_reflection(real lightColor, real specularColor, real diffuseFactor, real specularFactor) {
+  if (specularFactor > 0 && diffuseFactor > 0) {
+    return specularIntensity * lightColor * specularColor * specular_power(specularFactor);
+  }
+  else {
+    return 0.0;
+  }
+}
+
+// helper function to calculate radial attinuation
+real frad(real lightDistance, real a0, real a1, real a2) {
+  if (lightDistance == INFINITY ||
+      (equal(a0, 0.0) && equal(a1, 0.0) && equal(a2, 0.0))) {
+    return 1.0;
+  }
+  else {
+    return 1/(a2 * sqr(lightDistance) + (a1 * lightDistance) + a0);
+  }
+}
+
+// helper function to calculate angular attinuation
+// cosTheta is the cosine of the spot light's half angle, so comparing cosines
+// replaces comparing acos(lightToObj dot lightDirection) against theta
+real fang(real angularA0, real cosTheta, real* lightToObj, real* lightDirection) { // vl = lightDirection v0 = lightToObj
+  real cosAlpha = v3_dot(lightToObj, lightDirection);
+  if (cosAlpha < cosTheta) { // point isn't within spotlight
+     return 0.0;
+  }
+  else {
+    return pow(cosAlpha, angularA0);
+  }
+}
+
+// next_c() reads the next character of the mapped file and provides error
+// checking and line number maintenance
+int next_c(JsonInput* json) {
+  if (json->pos >= json->end) {
+    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
+    exit(1);
+  }
+  int c = (unsigned char)*json->pos++;
+  #ifdef DEBUG
+  printf("next_c: '%c'\n", c);
+  #endif
+  if (c == '\n') {
+    line += 1;
+  }
+  return c;
+}
+
+// expect_c() checks that the next character is d.  If it is not it emits
+// an error.
+void expect_c(JsonInput* json, int d) {
+  int c = next_c(json);
+  if (c == d) return;
+  fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
+  exit(1);
+}
+
+// skip_ws() skips white space in the file.
+void skip_ws(JsonInput* json) {
+  while (json->pos < json->end && isspace((unsigned char)*json->pos)) {
+    if (*json->pos == '\n') {
+      line += 1;
+    }
+    json->pos++;
+  }
+}
+
+// next_string() gets the next string from the file and emits an error
+// if a string can not be obtained.
+// The token points into the mapped file, nothing is copied or allocated.
+Token next_string(JsonInput* json) {
+  int c = next_c(json);
+  if (c != '"') {
+    fprintf(stderr, "Error: Expected string on line %d.\n", line);
+    exit(1);
+  }
+  Token token;
+  token.start = json->pos;
+  c = next_c(json);
+  while (c != '"') {
+    if (json->pos - token.start > 128) {
+      fprintf(stderr, "Error: Strings longer than 128 characters in length are not supported.\n");
+      exit(1);
+    }
+    if (c == '\\') {
+      fprintf(stderr, "Error: Strings with escape codes are not supported.\n");
+      exit(1);
+    }
+    if (c < 32 || c > 126) {
+      fprintf(stderr, "Error: Strings may contain only ascii characters.\n");
+      exit(1);
+    }
+    c = next_c(json);
+  }
+  token.length = json->pos - 1 - token.start;
+  return token;
+}
+
+// returns 1 if the token is the string s, 0 if not
+int token_equal(Token token, char* s) {
+  return strlen(s) == token.length && memcmp(token.start, s, token.length) == 0;
+}
+
+// parse the next number in the json file
+// Numbers with at most 19 significant digits and a small exponent are built
+// exactly from their digits, anything else goes through strtod(). Both round
+// correctly, so the result is the same as reading the number with fscanf().
+double next_number(JsonInput* json) {
+  static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  char* start = json->pos;
+  char* p = json->pos;
+  char* end = json->end;
+  int negative = 0;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+
+  unsigned long long mantissa = 0;
+  int digits = 0; // significant digits held in mantissa
+  int exponent = 0; // power of ten to scale mantissa by
+  int sawDigit = 0;
+  int exact = 1; // boolean, mantissa holds every digit
+  for (; p < end && isdigit((unsigned char)*p); p++) {
+    sawDigit = 1;
+    if (mantissa == 0 && *p == '0') continue; // leading zeros
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      digits++;
+    }
+    else {
+      exact = 0;
+    }
+  }
+  if (p < end && *p == '.') {
+    p++;
+    for (; p < end && isdigit((unsigned char)*p); p++) {
+      sawDigit = 1;
+      if (mantissa == 0 && *p == '0') {
+        exponent--; // leading zeros after the point only shift the value
+        continue;
+      }
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        digits++;
+        exponent--;
+      }
+      else {
+        exact = 0;
+      }
+    }
+  }
+  if (!sawDigit) {
+    number_error("Expected number");
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    int expNegative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+      expNegative = (*p == '-');
+      p++;
+    }
+    if (p >= end || !isdigit((unsigned char)*p)) {
+      number_error("Expected exponent");
+    }
+    int e = 0;
+    for (; p < end && isdigit((unsigned char)*p); p++) {
+      if (e < 100000) e = e * 10 + (*p - '0');
+    }
+    exponent += expNegative ? -e : e;
+  }
+  json->pos = p;
+
   double value;
-  fscanf(json, "%lf", &value);
-  return value;
+  if (mantissa == 0) {
+    value = 0.0;
+  }
+  else if (exact && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+    // both the mantissa and the power of ten are exact doubles, so a single
+    // multiply or divide rounds correctly
+    value = (exponent < 0) ? (double)mantissa / powers[-exponent] : (double)mantissa * powers[exponent];
+  }
+  else { // rare, hand the text to the C library
+    char buffer[128];
+    size_t length = p - start;
+    if (length >= sizeof(buffer)) {
+      number_error("Number too long");
+    }
+    memcpy(buffer, start, length);
+    buffer[length] = 0;
+    return strtod(buffer, NULL);
+  }
+  return negative ? -value : value;
+}
+
+// report a malformed number on the current line, in the OBJ file being read
+// if there is one, and exit
+void number_error(char* message) {
+  if (objName != NULL) {
+    fprintf(stderr, "Error: %s in \"%s\" on line %d.\n", message, objName, line);
+  }
+  else {
+    fprintf(stderr, "Error: %s on line %d.\n", message, line);
+  }
+  exit(1);
+}
+
+// parse the next vector in the json file (array of 3 doubles)
+void next_vector(JsonInput* json, real* v) {
+  expect_c(json, '[');
+  skip_ws(json);
+  v[0] = next_number(json);
+  skip_ws(json);
+  expect_c(json, ',');
+  skip_ws(json);
+  v[1] = next_number(json);
+  skip_ws(json);
+  expect_c(json, ',');
+  skip_ws(json);
+  v[2] = next_number(json);
+  skip_ws(json);
+  expect_c(json, ']');
+}
+
+// memory map the json file filename for parsing, starting at line 1
+void map_json(char* filename, JsonInput* json) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    fprintf(stderr, "Error: Could not read file \"%s\"\n", filename);
+    exit(1);
+  }
+  json->data = NULL;
+  if (info.st_size > 0) {
+    json->data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (json->data == MAP_FAILED) {
+      fprintf(stderr, "Error: Could not read file \"%s\"\n", filename);
+      exit(1);
+    }
+    madvise(json->data, info.st_size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  json->pos = json->data;
+  json->end = json->data + info.st_size;
+  line = 1;
+}
+
+// parse a json file based on filename and place any objects into object array
+// The file is memory mapped and tokenized in a single pass without copying.
+void read_scene(char* filename) {
+
+  int c;
+  JsonInput input;
+  JsonInput* json = &input;
+  map_json(filename, json);
+  int camFlag = 0; // boolean to see if we have a camera obj yet
+  char meshFile[PATH_MAX]; // OBJ file of the mesh being parsed, empty until given
+
+  skip_ws(json);
+  expect_c(json, '['); // Find the beginning of the list
+  skip_ws(json);
+
+  // Find the objects
+  while (1) {
+
+    c = next_c(json);
+    if (c == ']') {
+      fprintf(stderr, "Error: Empty object at line %d.\n", line);
+      break;
+    }
+    if (c != '{') {
+      fprintf(stderr, "Error: Expected '{' on line %d.\n", line);
+      exit(1);
+    }
+    skip_ws(json);
+    // Parse the object
+    Token key = next_string(json);
+    if (!token_equal(key, "type")) {
+      fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
+      exit(1);
+    }
+    skip_ws(json);
+    expect_c(json, ':');
+    skip_ws(json);
+    Token value = next_string(json);
+
+    int kind;
+    if (token_equal(value, "plane")) {
+      physicalObjects = reserve_object(physicalObjects, numPhysicalObjects, &physicalCapacity);
+      physicalObjects[numPhysicalObjects].kind = 0;
+      kind = 0;
+    }
+    else if (token_equal(value, "sphere")) {
+      physicalObjects = reserve_object(physicalObjects, numPhysicalObjects, &physicalCapacity);
+      physicalObjects[numPhysicalObjects].kind = 1;
+      kind = 1;
+    }
+    else if (token_equal(value, "mesh")) {
+      physicalObjects = reserve_object(physicalObjects, numPhysicalObjects, &physicalCapacity);
+      physicalObjects[numPhysicalObjects].kind = 4;
+      physicalObjects[numPhysicalObjects].mesh.scale = 1;
+      meshFile[0] = 0;
+      kind = 4;
+    }
+    else if (token_equal(value, "light")) {
+      lightObjects = reserve_object(lightObjects, numLightObjects, &lightCapacity);
+      lightObjects[numLightObjects].kind = 2;
+      kind = 2;
+    }
+    else if (token_equal(value, "camera")) {
+      if (camFlag == 1) {
+        fprintf(stderr, "Error: Too many camera objects, see line: %d.\n", line);
+        exit(1);
+      }
+      cameraObject.kind = 3;
+      cameraObject.position[0] = 0;
+      cameraObject.position[1] = 0;
+      cameraObject.position[2] = 0;
+      camFlag = 1;
+      kind = 3;
+    }
+    else {
+      fprintf(stderr, "Error: Unknown type, \"%.*s\", on line number %d.\n", (int)value.length, value.start, line);
+      exit(1);
+    }
+    Object* obj = NULL; // the object whose fields are being read
+    if (kind == 0 || kind == 1 || kind == 4) obj = &physicalObjects[numPhysicalObjects];
+    else if (kind == 2) obj = &lightObjects[numLightObjects];
+    else obj = &cameraObject;
+    skip_ws(json);
+
+    while (1) { // parse the current object
+
+      c = next_c(json);
+      if (c == '}') {
+        break; // stop parsing this object
+      }
+      else if (c == ',') {
+        // read another field
+        skip_ws(json);
+        Token key = next_string(json);
+        skip_ws(json);
+        expect_c(json, ':');
+        skip_ws(json);
+        if (token_equal(key, "width")) {
+          real value = next_number(json);
+          if (kind == 3) {
+            obj->camera.width = value;
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'width' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "height")) {
+          real value = next_number(json);
+          if (kind == 3) {
+            obj->camera.height = value;
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'height' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "radius")) {
+          real value = next_number(json);
+          if (kind == 1) {
+            obj->sphere.radius = value;
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'radius' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "scale")) {
+          real value = next_number(json);
+          if (kind == 4) {
+            obj->mesh.scale = value;
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'scale' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "file")) {
+          Token value = next_string(json);
+          if (kind != 4) {
+            fprintf(stderr, "Error: Unexpected 'file' attribute on line %d.\n", line);
+            exit(1);
+          }
+          // relative to --mesh-dir if given, else to the directory of the scene, like an include
+          char* slash = strrchr(filename, '/');
+          int absolute = value.length > 0 && value.start[0] == '/';
+          if (!absolute && meshDirectory != NULL && meshDirectory[0] == 0) {
+            fprintf(stderr, "Error: Relative mesh file name on line %d, but no directory to find it in.\n", line);
+            exit(1);
+          }
+          size_t directory = 0;
+          if (!absolute && meshDirectory != NULL) {
+            directory = snprintf(meshFile, sizeof(meshFile), "%s/", meshDirectory);
+          }
+          else if (!absolute && slash != NULL) {
+            directory = snprintf(meshFile, sizeof(meshFile), "%.*s", (int)(slash + 1 - filename), filename);
+          }
+          if (directory + value.length >= sizeof(meshFile)) {
+            fprintf(stderr, "Error: Mesh file name too long on line %d.\n", line);
+            exit(1);
+          }
+          memcpy(meshFile + directory, value.start, value.length);
+          meshFile[directory + value.length] = 0;
+        }
+        else if (token_equal(key, "color")) {
+          real value[3];
+          next_vector(json, value);
+          if (kind == 0 || kind == 1 || kind == 2 || kind == 4) {
+            memcpy(obj->color, value, sizeof(real) * 3);
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'color' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "diffuse_color")) {
+          real value[3];
+          next_vector(json, value);
+          if (kind == 0 || kind == 1 || kind == 4) {
+            memcpy(obj->diffuseColor, value, sizeof(real) * 3);
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'diffuse_color' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "specular_color")) {
+          real value[3];
+          next_vector(json, value);
+          if (kind == 0 || kind == 1 || kind == 4) {
+            memcpy(obj->specularColor, value, sizeof(real) * 3);
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'specular_color' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "position")) {
+          real value[3];
+          next_vector(json, value);
+          if (kind == 0 || kind == 1 || kind == 2 || kind == 4) {
+            memcpy(obj->position, value, sizeof(real) * 3);
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'position' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "normal")) {
+          real value[3];
+          next_vector(json, value);
+          if (kind == 0) {
+            memcpy(obj->plane.normal, value, sizeof(real) * 3);
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'normal' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "direction")) {
+          real value[3];
+          next_vector(json, value);
+          if (kind == 2) {
+            memcpy(obj->light.direction, value, sizeof(real) * 3);
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'direction' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "radial-a0")) {
+          real value = next_number(json);
+          if (kind == 2) {
+            obj->light.radialA0 = value;
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'radial-a0' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "radial-a1")) {
+          real value = next_number(json);
+          if (kind == 2) {
+            obj->light.radialA1 = value;
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'radial-a1' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "radial-a2")) {
+          real value = next_number(json);
+          if (kind == 2) {
+            obj->light.radialA2 = value;
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'radial-a2' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "angular-a0")) {
+          real value = next_number(json);
+          if (kind == 2) {
+            obj->light.angularA0 = value;
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'angular-a0' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else if (token_equal(key, "theta")) {
+          real value = next_number(json);
+          if (kind == 2) {
+            obj->light.theta = value;
+          }
+          else {
+            fprintf(stderr, "Error: Unexpected 'theta' attribute on line %d.\n", line);
+            exit(1);
+          }
+        }
+        else {
+          fprintf(stderr, "Error: Unknown property, \"%.*s\", on line %d.\n", (int)key.length, key.start, line);
+          exit(1);
+        }
+        skip_ws(json);
+      }
+      else {
+        fprintf(stderr, "Error: Unexpected value on line %d\n", line);
+        exit(1);
+      }
+    } // end loop through object fields
+
+    if (kind == 4) { // read the triangles, now that the position and scale are known
+      if (meshFile[0] == 0) {
+        fprintf(stderr, "Error: Mesh without a 'file' attribute, ending on line %d.\n", line);
+        exit(1);
+      }
+      int sceneLine = line;
+      read_obj(meshFile, obj, numPhysicalObjects);
+      line = sceneLine;
+    }
+
+    // increment appropriate counter
+    if (kind == 0 || kind == 1 || kind == 4) {
+      numPhysicalObjects++;
+    }
+    else if (kind == 2) {
+      numLightObjects++;
+    }
+
+    skip_ws(json);
+    c = next_c(json);
+    if (c == ',') {
+      skip_ws(json);
+    }
+    else if (c == ']') {
+      break;
+    }
+    else {
+      fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
+      exit(1);
+    }
+  } // end loop through all objects in scene
+
+  if (input.data != NULL) {
+    munmap(input.data, input.end - input.data);
+  }
+  if (camFlag == 0) { // ensure that we parsed a camera
+    fprintf(stderr, "Error: The JSON file does not contain a camera object.\n");
+    exit(1);
+  }
+
+  // the scene is complete, give back the unused capacity
+  physicalObjects = shrink_objects(physicalObjects, numPhysicalObjects, &physicalCapacity);
+  lightObjects = shrink_objects(lightObjects, numLightObjects, &lightCapacity);
+  if (numMeshVertices > 0 && numMeshVertices < vertexCapacity) {
+    float* shrunk = realloc(meshVertices, (size_t)numMeshVertices * 3 * sizeof(float));
+    if (shrunk != NULL) {
+      meshVertices = shrunk;
+      vertexCapacity = numMeshVertices;
+    }
+  }
+  if (numMeshTriangles > 0 && numMeshTriangles < triangleCapacity) {
+    MeshTriangle* shrunk = realloc(meshTriangles, (size_t)numMeshTriangles * sizeof(MeshTriangle));
+    if (shrunk != NULL) {
+      meshTriangles = shrunk;
+      triangleCapacity = numMeshTriangles;
+    }
+  }
+}
+
+// Read the vertices and faces of the Wavefront OBJ file filename into
+// meshVertices and meshTriangles, as the mesh obj, which is physical object
+// surface. Vertices are scaled by obj->mesh.scale and moved by obj->position,
+// faces of more than three vertices are split into a fan of triangles, and
+// every other statement, such as normals, texture coordinates and groups, is
+// skipped.
+void read_obj(char* filename, Object* obj, int surface) {
+  JsonInput input;
+  JsonInput* json = &input;
+  map_json(filename, json);
+  record_mesh_source(filename, json);
+  objName = filename; // for the errors of next_number()
+  int firstVertex = numMeshVertices;
+  obj->mesh.firstTriangle = numMeshTriangles;
+
+  while (1) {
+    skip_blanks(json);
+    if (json->pos >= json->end) break;
+    char* p = json->pos;
+    int statement = (p + 1 < json->end && (p[1] == ' ' || p[1] == '\t')) ? p[0] : 0;
+
+    if (statement == 'v') { // vertex, x y z
+      json->pos++;
+      meshVertices = reserve_array(meshVertices, numMeshVertices, &vertexCapacity, 3 * sizeof(float), filename);
+      float* vertex = &meshVertices[3 * numMeshVertices];
+      for (int axis = 0; axis < 3; axis++) {
+        skip_blanks(json);
+        vertex[axis] = (float)(next_number(json) * obj->mesh.scale + obj->position[axis]);
+      }
+      numMeshVertices++;
+    }
+    else if (statement == 'f') { // face, a vertex index per corner, each maybe followed by /texture/normal
+      json->pos++;
+      int corners = 0;
+      uint32_t first = 0;
+      uint32_t previous = 0;
+      while (1) {
+        skip_blanks(json);
+        if (json->pos >= json->end || *json->pos == '\n' || *json->pos == '#') break;
+        uint32_t vertex = obj_index(json, firstVertex, filename);
+        while (json->pos < json->end && !isspace((unsigned char)*json->pos)) {
+          json->pos++; // the texture and normal indices are not used
+        }
+        if (corners == 0) {
+          first = vertex;
+        }
+        else if (corners >= 2) {
+          meshTriangles = reserve_array(meshTriangles, numMeshTriangles, &triangleCapacity, sizeof(MeshTriangle), filename);
+          MeshTriangle* triangle = &meshTriangles[numMeshTriangles++];
+          triangle->v[0] = first;
+          triangle->v[1] = previous;
+          triangle->v[2] = vertex;
+          triangle->surface = surface;
+        }
+        previous = vertex;
+        corners++;
+      }
+      if (corners < 3) {
+        fprintf(stderr, "Error: Face with fewer than 3 vertices in \"%s\" on line %d.\n", filename, line);
+        exit(1);
+      }
+    }
+
+    while (json->pos < json->end && *json->pos != '\n') {
+      json->pos++; // the rest of the line, or a statement that is not used
+    }
+    if (json->pos < json->end) {
+      next_c(json);
+    }
+  }
+
+  if (input.data != NULL) {
+    munmap(input.data, input.end - input.data);
+  }
+  objName = NULL;
+  obj->mesh.numTriangles = numMeshTriangles - obj->mesh.firstTriangle;
+  if (obj->mesh.numTriangles == 0) {
+    fprintf(stderr, "Error: \"%s\" does not contain any faces.\n", filename);
+    exit(1);
+  }
+}
+
+// skip spaces, tabs and carriage returns in an OBJ file, stopping at the end
+// of the line
+void skip_blanks(JsonInput* json) {
+  while (json->pos < json->end && (*json->pos == ' ' || *json->pos == '\t' || *json->pos == '\r')) {
+    json->pos++;
+  }
+}
+
+// parse the vertex index of a face corner in an OBJ file, counting from 1
+// at the first vertex of the file, or back from the last vertex read when
+// negative, and return its index in meshVertices
+uint32_t obj_index(JsonInput* json, int firstVertex, char* filename) {
+  int negative = 0;
+  if (json->pos < json->end && *json->pos == '-') {
+    negative = 1;
+    json->pos++;
+  }
+  long long value = 0;
+  int digits = 0;
+  while (json->pos < json->end && isdigit((unsigned char)*json->pos)) {
+    if (value < INT_MAX) value = value * 10 + (*json->pos - '0');
+    json->pos++;
+    digits++;
+  }
+  if (digits == 0) {
+    fprintf(stderr, "Error: Expected vertex index in \"%s\" on line %d.\n", filename, line);
+    exit(1);
+  }
+  if (value < 1 || value > numMeshVertices - firstVertex) {
+    fprintf(stderr, "Error: Vertex %s%lld is not defined before line %d of \"%s\".\n",
+      negative ? "-" : "", value, line, filename);
+    exit(1);
+  }
+  return negative ? numMeshVertices - value : firstVertex + value - 1;
+}
+
+// make room in array, holding count items of size bytes in room for capacity,
+// for one more item, doubling its capacity as needed
+// Returns the array, which may have moved
+void* reserve_array(void* array, int count, int* capacity, size_t size, char* filename) {
+  if (count >= *capacity) {
+    int newCapacity = (*capacity < initialObjects) ? initialObjects : *capacity;
+    while (newCapacity <= count) {
+      if (newCapacity > INT_MAX / 2) {
+        fprintf(stderr, "Error: Too many vertices or faces in \"%s\", see line: %d.\n", filename, line);
+        exit(1);
+      }
+      newCapacity *= 2;
+    }
+    array = realloc(array, (size_t)newCapacity * size);
+    if (array == NULL) {
+      fprintf(stderr, "Error: Out of memory while reading \"%s\" on line %d.\n", filename, line);
+      exit(1);
+    }
+    *capacity = newCapacity;
+  }
+  return array;
+}
+
+// add the OBJ file filename, mapped in json, to meshSources, so a compiled
+// scene can tell when it changes. A file several meshes use is recorded once.
+void record_mesh_source(char* filename, JsonInput* json) {
+  char* path = realpath(filename, NULL);
+  struct stat info;
+  if (path == NULL || stat(path, &info) != 0) {
+    fprintf(stderr, "Error: Could not read file \"%s\"\n", filename);
+    exit(1);
+  }
+  if (strlen(path) >= sizeof(meshSources->path)) {
+    fprintf(stderr, "Error: Mesh file name too long: \"%s\"\n", path);
+    exit(1);
+  }
+  for (int i = 0; i < numMeshSources; i++) {
+    if (strcmp(meshSources[i].path, path) == 0) {
+      free(path);
+      return;
+    }
+  }
+  meshSources = reserve_array(meshSources, numMeshSources, &sourceCapacity, sizeof(MeshSource), filename);
+  MeshSource* source = &meshSources[numMeshSources++];
+  memset(source, 0, sizeof(MeshSource)); // the whole path is written to compiled scene files
+  strcpy(source->path, path);
+  source->size = json->end - json->data;
+  source->modified = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+  source->hash = hash_bytes(hash_bytes(0, NULL, 0), json->data, source->size); // as hash_file() would
+  free(path);
+}
+
+// benchmark of read_scene(), loads the file runs times and prints the time
+// taken by the fastest and the average load
+void bench_load(char* filename, int runs) {
+  double best = INFINITY;
+  double total = 0.0;
+  for (int r = 0; r < runs; r++) {
+    free(physicalObjects);
+    free(lightObjects);
+    physicalObjects = NULL;
+    lightObjects = NULL;
+    numPhysicalObjects = numLightObjects = 0;
+    physicalCapacity = lightCapacity = 0;
+    free(meshVertices);
+    free(meshTriangles);
+    free(meshSources);
+    meshVertices = NULL;
+    meshTriangles = NULL;
+    meshSources = NULL;
+    numMeshVertices = numMeshTriangles = numMeshSources = 0;
+    vertexCapacity = triangleCapacity = sourceCapacity = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    read_scene(filename);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    total += elapsed;
+    if (elapsed < best) best = elapsed;
+  }
+
+  struct stat info;
+  stat(filename, &info);
+  printf("read_scene(\"%s\"): %d objects, %d lights, %d triangles, %.1f MB\n", filename,
+    numPhysicalObjects, numLightObjects, numMeshTriangles, info.st_size / 1e6);
+  printf("  best %.3f ms, mean %.3f ms over %d runs, %.0f MB/s\n",
+    best * 1e3, total / runs * 1e3, runs, info.st_size / 1e6 / best);
+}
+
+// load the scene in filename into scene, ready for rendering
+// Compiled scene files are mapped and used as they are. If the json a
+// compiled scene was made from has changed since, it is compiled again and
+// the file rewritten. Anything else is parsed as json and compiled.
+void load_scene(char* filename, Scene* scene) {
+  SceneCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  FILE* fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+  size_t headerBytes = fread(&header, 1, sizeof(header), fh);
+  fclose(fh);
+
+  if (headerBytes < sizeof(header.magic) || memcmp(header.magic, sceneCacheMagic, sizeof(header.magic)) != 0) {
+    read_scene(filename); // plain json
+    compile_scene(scene);
+  }
+  else if (!load_scene_cache(filename, scene)) {
+    header.sourcePath[sizeof(header.sourcePath) - 1] = 0;
+    fprintf(stderr, "Note: \"%s\" is out of date, recompiling it from \"%s\".\n", filename, header.sourcePath);
+    read_scene(header.sourcePath);
+    compile_scene(scene);
+    write_scene_cache(header.sourcePath, filename, scene);
+  }
+  select_kernels();
+  bound_lights(scene);
+}
+
+// get the location and size in bytes of every array of a scene, in the order
+// they are stored in a compiled scene file
+void scene_sections(Scene* scene, void** sections[], size_t lengths[]) {
+  size_t numSpheres = scene->numSpheres;
+  size_t paddedSpheres = (numSpheres + kernelLanes) * sizeof(real); // kernels read past the end
+  size_t paddedPlanes = (scene->numPlanes + kernelLanes) * sizeof(real);
+  void** pointers[sceneCacheSections] = {
+    (void**)&scene->surfaces, (void**)&scene->lights, (void**)&scene->bvhNodes,
+    (void**)&scene->bvhIndices, (void**)&scene->planeIndices,
+    (void**)&scene->spheres.x, (void**)&scene->spheres.y, (void**)&scene->spheres.z, (void**)&scene->spheres.radius,
+    (void**)&scene->planes.x, (void**)&scene->planes.y, (void**)&scene->planes.z, (void**)&scene->planes.d,
+    (void**)&scene->vertices, (void**)&scene->triangles, (void**)&scene->meshNodes,
+    (void**)&scene->meshSources
+  };
+  size_t sizes[sceneCacheSections] = {
+    scene->numSurfaces * sizeof(Surface), scene->numLights * sizeof(Light), scene->numBVHNodes * sizeof(BVHNode),
+    numSpheres * sizeof(int), scene->numPlanes * sizeof(int),
+    paddedSpheres, paddedSpheres, paddedSpheres, paddedSpheres,
+    paddedPlanes, paddedPlanes, paddedPlanes, paddedPlanes,
+    scene->numVertices * 3 * sizeof(float), scene->numTriangles * sizeof(MeshTriangle),
+    scene->numMeshNodes * sizeof(MeshNode), scene->numMeshSources * sizeof(MeshSource)
+  };
+  memcpy(sections, pointers, sizeof(pointers));
+  memcpy(lengths, sizes, sizeof(sizes));
+}
+
+// write a compiled scene file holding scene, which was compiled from jsonName
+// The file is written next to cacheName and renamed over it once complete,
+// so a reader never maps a half written file
+void write_scene_cache(char* jsonName, char* cacheName, Scene* scene) {
+  SceneCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, sceneCacheMagic, sizeof(header.magic));
+  header.version = sceneCacheVersion;
+  header.realSize = sizeof(real);
+  header.surfaceSize = sizeof(Surface);
+  header.lightSize = sizeof(Light);
+  header.nodeSize = sizeof(BVHNode);
+  header.meshNodeSize = sizeof(MeshNode);
+  header.meshSourceSize = sizeof(MeshSource);
+  header.numSurfaces = scene->numSurfaces;
+  header.numLights = scene->numLights;
+  header.numBVHNodes = scene->numBVHNodes;
+  header.numPlanes = scene->numPlanes;
+  header.numSpheres = scene->numSpheres;
+  header.numVertices = scene->numVertices;
+  header.numTriangles = scene->numTriangles;
+  header.numMeshNodes = scene->numMeshNodes;
+  header.numMeshSources = scene->numMeshSources;
+  for (int i = 0; i < 3; i++) {
+    header.cameraPosition[i] = scene->cameraPosition[i];
+  }
+  header.cameraWidth = scene->cameraWidth;
+  header.cameraHeight = scene->cameraHeight;
+  header.sourceHash = hash_file(jsonName, &header.sourceSize, &header.sourceModified);
+  char* source = realpath(jsonName, NULL);
+  snprintf(header.sourcePath, sizeof(header.sourcePath), "%s", source != NULL ? source : jsonName);
+  free(source);
+
+  void** sections[sceneCacheSections];
+  size_t lengths[sceneCacheSections];
+  scene_sections(scene, sections, lengths);
+  uint64_t offset = (sizeof(header) + sceneCacheAlign - 1) / sceneCacheAlign * sceneCacheAlign;
+  header.checksum = hash_bytes(0, NULL, 0);
+  for (int i = 0; i < sceneCacheSections; i++) {
+    header.offsets[i] = offset;
+    header.lengths[i] = lengths[i];
+    header.checksum = hash_bytes(header.checksum, *sections[i], lengths[i]);
+    offset += (lengths[i] + sceneCacheAlign - 1) / sceneCacheAlign * sceneCacheAlign;
+  }
+
+  char* tempName = malloc(strlen(cacheName) + 5);
+  sprintf(tempName, "%s.tmp", cacheName);
+  FILE* fh = fopen(tempName, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", tempName);
+    exit(1);
+  }
+  static const char zeros[sceneCacheAlign] = {0};
+  size_t written = fwrite(&header, 1, sizeof(header), fh);
+  uint64_t position = sizeof(header);
+  for (int i = 0; i < sceneCacheSections; i++) {
+    written += fwrite(zeros, 1, header.offsets[i] - position, fh); // align the array
+    if (lengths[i] > 0) { // the array of a kind the scene has none of may be NULL
+      written += fwrite(*sections[i], 1, lengths[i], fh);
+    }
+    position = header.offsets[i] + lengths[i];
+  }
+  if (written != position || fclose(fh) != 0 || rename(tempName, cacheName) != 0) {
+    fprintf(stderr, "Error: Could not write compiled scene \"%s\"\n", cacheName);
+    exit(1);
+  }
+  free(tempName);
+}
+
+// map a compiled scene file and point scene's arrays into it
+// Returns 1 on success, 0 if the file is stale, corrupt or from another
+// version and needs compiling again
+int load_scene_cache(char* cacheName, Scene* scene) {
+  int fd = open(cacheName, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", cacheName);
+    exit(1);
+  }
+  if ((size_t)info.st_size < sizeof(SceneCacheHeader)) {
+    close(fd);
+    return 0;
+  }
+  char* base = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0); // private, animation writes never reach the file
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not read file \"%s\"\n", cacheName);
+    exit(1);
+  }
+  SceneCacheHeader* header = (SceneCacheHeader*)base;
+
+  int valid = header->version == sceneCacheVersion &&
+    header->realSize == sizeof(real) &&
+    header->surfaceSize == sizeof(Surface) &&
+    header->lightSize == sizeof(Light) &&
+    header->nodeSize == sizeof(BVHNode) &&
+    header->meshNodeSize == sizeof(MeshNode) &&
+    header->meshSourceSize == sizeof(MeshSource) &&
+    header->numPlanes >= 0 && header->numSpheres >= 0 &&
+    header->numPlanes + header->numSpheres <= header->numSurfaces;
+
+  // has the json changed since? the hash settles it when only the time differs
+  if (valid) {
+    struct stat source;
+    char path[sizeof(header->sourcePath)];
+    memcpy(path, header->sourcePath, sizeof(path));
+    path[sizeof(path) - 1] = 0;
+    if (stat(path, &source) == 0 &&
+        ((uint64_t)source.st_size != header->sourceSize ||
+         (int64_t)source.st_mtim.tv_sec * 1000000000 + source.st_mtim.tv_nsec != header->sourceModified)) {
+      uint64_t size;
+      int64_t modified;
+      valid = hash_file(path, &size, &modified) == header->sourceHash;
+    }
+  }
+
+  Scene loaded;
+  memset(&loaded, 0, sizeof(loaded));
+  void** sections[sceneCacheSections];
+  size_t lengths[sceneCacheSections];
+  if (valid) {
+    loaded.numSurfaces = header->numSurfaces;
+    loaded.numLights = header->numLights;
+    loaded.numBVHNodes = header->numBVHNodes;
+    loaded.numPlanes = header->numPlanes;
+    loaded.numSpheres = header->numSpheres;
+    loaded.numVertices = header->numVertices;
+    loaded.numTriangles = header->numTriangles;
+    loaded.numMeshNodes = header->numMeshNodes;
+    loaded.numMeshSources = header->numMeshSources;
+    scene_sections(&loaded, sections, lengths);
+    uint64_t checksum = hash_bytes(0, NULL, 0);
+    for (int i = 0; i < sceneCacheSections && valid; i++) {
+      valid = header->lengths[i] == lengths[i] &&
+        header->offsets[i] % sceneCacheAlign == 0 &&
+        header->offsets[i] <= (uint64_t)info.st_size &&
+        lengths[i] <= (uint64_t)info.st_size - header->offsets[i];
+      if (valid) {
+        *sections[i] = base + header->offsets[i];
+        checksum = hash_bytes(checksum, *sections[i], lengths[i]);
+      }
+    }
+    valid = valid && checksum == header->checksum;
+    valid = valid && mesh_sources_current(&loaded); // and the OBJ files, the same way
+  }
+
+  if (!valid) {
+    munmap(base, info.st_size);
+    return 0;
+  }
+  for (int i = 0; i < 3; i++) {
+    loaded.cameraPosition[i] = header->cameraPosition[i];
+  }
+  loaded.cameraWidth = header->cameraWidth;
+  loaded.cameraHeight = header->cameraHeight;
+  loaded.cacheMapping = base;
+  loaded.cacheLength = info.st_size;
+  *scene = loaded;
+  return 1;
+}
+
+// check whether the OBJ files scene's meshes were read from are unchanged
+// since it was compiled, as load_scene_cache() checks the json: the hash
+// settles it when only the time differs, and a file that is gone is not
+// taken for a change
+// Returns 1 if none changed, 0 if any did
+int mesh_sources_current(Scene* scene) {
+  for (int i = 0; i < scene->numMeshSources; i++) {
+    MeshSource* source = &scene->meshSources[i];
+    char path[sizeof(source->path)];
+    memcpy(path, source->path, sizeof(path));
+    path[sizeof(path) - 1] = 0;
+    struct stat info;
+    if (stat(path, &info) != 0) continue;
+    if ((uint64_t)info.st_size != source->size) return 0;
+    if ((int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec != source->modified) {
+      uint64_t size;
+      int64_t modified;
+      if (hash_file(path, &size, &modified) != source->hash) return 0;
+    }
+  }
+  return 1;
+}
+
+// continue a 64 bit hash over length bytes of data, pass 0 to start one
+// Used to checksum compiled scene files and to notice changed json files
+uint64_t hash_bytes(uint64_t hash, void* data, size_t length) {
+  if (hash == 0) hash = 14695981039346656037ULL; // FNV offset basis
+  unsigned char* bytes = data;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) { // a word at a time
+    uint64_t word;
+    memcpy(&word, &bytes[i], 8);
+    hash ^= word;
+    hash *= 1099511628211ULL; // FNV prime
+    hash ^= hash >> 32;
+  }
+  for (; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// hash the contents of a file, storing its size and modification time in
+// nanoseconds
+uint64_t hash_file(char* filename, uint64_t* size, int64_t* modified) {
+  int fd = open(filename, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+  *size = info.st_size;
+  *modified = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+  uint64_t hash = hash_bytes(0, NULL, 0);
+  if (info.st_size > 0) {
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Error: Could not read file \"%s\"\n", filename);
+      exit(1);
+    }
+    hash = hash_bytes(hash, data, info.st_size);
+    munmap(data, info.st_size);
+  }
+  close(fd);
+  return hash;
+}
+
+// compile the parsed scene into render-ready records
+// Everything that depends only on the scene is worked out here once, rather
+// than for every pixel: unit plane normals and their distance terms, unit spot
+// directions, the cosine of each spot cone and which attenuation terms a
+// light needs. The render threads only ever read the result.
+void compile_scene(Scene* scene) {
+  scene->numSurfaces = numPhysicalObjects;
+  scene->surfaces = malloc((numPhysicalObjects + 1) * sizeof(Surface));
+  for (int i = 0; i < numPhysicalObjects; i++) {
+    Object* obj = &physicalObjects[i];
+    Surface* surface = &scene->surfaces[i];
+    memset(surface, 0, sizeof(Surface));
+    surface->kind = obj->kind;
+    memcpy(surface->position, obj->position, sizeof(surface->position));
+    memcpy(surface->diffuseColor, obj->diffuseColor, sizeof(surface->diffuseColor));
+    memcpy(surface->specularColor, obj->specularColor, sizeof(surface->specularColor));
+    if (obj->kind == 0) { // plane
+      memcpy(surface->normal, obj->plane.normal, sizeof(surface->normal));
+      normalize(surface->normal);
+      surface->d = -v3_dot(surface->normal, surface->position);
+    }
+    else if (obj->kind == 1) { // sphere
+      surface->radius = obj->sphere.radius;
+    }
+  }
+
+  // the scene takes over the triangles of every mesh
+  scene->vertices = meshVertices;
+  scene->numVertices = numMeshVertices;
+  scene->triangles = meshTriangles;
+  scene->numTriangles = numMeshTriangles;
+  meshVertices = NULL;
+  numMeshVertices = 0;
+  vertexCapacity = 0;
+  meshTriangles = NULL;
+  numMeshTriangles = 0;
+  triangleCapacity = 0;
+  scene->meshSources = meshSources;
+  scene->numMeshSources = numMeshSources;
+  meshSources = NULL;
+  numMeshSources = 0;
+  sourceCapacity = 0;
+
+  scene->numLights = numLightObjects;
+  scene->lights = malloc((numLightObjects + 1) * sizeof(Light));
+  for (int i = 0; i < numLightObjects; i++) {
+    Object* obj = &lightObjects[i];
+    Light* light = &scene->lights[i];
+    memset(light, 0, sizeof(Light));
+    memcpy(light->position, obj->position, sizeof(light->position));
+    memcpy(light->color, obj->color, sizeof(light->color));
+    memcpy(light->direction, obj->light.direction, sizeof(light->direction));
+    normalize(light->direction);
+    light->radialA0 = obj->light.radialA0;
+    light->radialA1 = obj->light.radialA1;
+    light->radialA2 = obj->light.radialA2;
+    light->angularA0 = obj->light.angularA0;
+
+    light->lightClass = 0;
+    if (!(equal(light->radialA0, 0.0) && equal(light->radialA1, 0.0) && equal(light->radialA2, 0.0))) {
+      light->lightClass |= lightAttenuated;
+    }
+    real theta = obj->light.theta;
+    if (!equal(theta, 0.0)) { // spot light
+      light->lightClass |= lightSpot;
+      if (theta < 0) {
+        light->cosTheta = 2.0; // no point is ever inside the cone
+      }
+      else if (theta >= 180) {
+        light->cosTheta = -2.0; // every point is inside the cone
+      }
+      else {
+        light->cosTheta = cos(theta * (M_PI / 180.0));
+      }
+    }
+  }
+
+  memcpy(scene->cameraPosition, cameraObject.position, sizeof(scene->cameraPosition));
+  scene->cameraWidth = cameraObject.camera.width;
+  scene->cameraHeight = cameraObject.camera.height;
+
+  build_bvh(scene);
+  build_kernel_arrays(scene);
+  build_mesh_bvh(scene);
+}
+
+// free everything compile_scene() allocated, or unmap the compiled scene file
+void free_scene(Scene* scene) {
+  free(scene->lightRadii); // always allocated, even for a mapped scene
+  if (scene->cacheMapping != NULL) { // the arrays live in the mapped file
+    munmap(scene->cacheMapping, scene->cacheLength);
+    memset(scene, 0, sizeof(Scene));
+    return;
+  }
+  free(scene->surfaces);
+  free(scene->lights);
+  free(scene->bvhNodes);
+  free(scene->bvhIndices);
+  free(scene->planeIndices);
+  free(scene->spheres.x);
+  free(scene->spheres.y);
+  free(scene->spheres.z);
+  free(scene->spheres.radius);
+  free(scene->planes.x);
+  free(scene->planes.y);
+  free(scene->planes.z);
+  free(scene->planes.d);
+  free(scene->vertices);
+  free(scene->triangles);
+  free(scene->meshNodes);
+  free(scene->meshSources);
+  memset(scene, 0, sizeof(Scene));
+}
+
+// build the bounding volume hierarchy over the spheres in the scene, planes
+// are infinite and go into their own list instead, and meshes have their own
+void build_bvh(Scene* scene) {
+  int numSpheres = 0;
+  scene->numPlanes = 0;
+  for (int i = 0; i < scene->numSurfaces; i++) {
+    if (scene->surfaces[i].kind == 1) numSpheres++;
+    else if (scene->surfaces[i].kind == 0) scene->numPlanes++;
+  }
+  scene->numSpheres = numSpheres;
+
+  scene->planeIndices = malloc((scene->numPlanes + 1) * sizeof(int));
+  scene->bvhIndices = malloc((numSpheres + 1) * sizeof(int));
+  numSpheres = 0;
+  scene->numPlanes = 0;
+  for (int i = 0; i < scene->numSurfaces; i++) {
+    if (scene->surfaces[i].kind == 1) scene->bvhIndices[numSpheres++] = i;
+    else if (scene->surfaces[i].kind == 0) scene->planeIndices[scene->numPlanes++] = i;
+  }
+
+  // a binary tree with leaves of at least one sphere has fewer than 2n nodes
+  scene->bvhNodes = malloc((2 * numSpheres + 1) * sizeof(BVHNode));
+  scene->numBVHNodes = 0;
+  if (numSpheres > 0) {
+    scene->numBVHNodes = 1;
+    build_bvh_node(scene, 0, 0, numSpheres);
+  }
+}
+
+// copy the spheres and planes into the structure of arrays layout read by the
+// batched intersection kernels, padded so a kernel may read a full vector
+void build_kernel_arrays(Scene* scene) {
+  int numSpheres = scene->numSpheres;
+  SphereArrays* spheres = &scene->spheres;
+  spheres->x = calloc(numSpheres + kernelLanes, sizeof(real));
+  spheres->y = calloc(numSpheres + kernelLanes, sizeof(real));
+  spheres->z = calloc(numSpheres + kernelLanes, sizeof(real));
+  spheres->radius = calloc(numSpheres + kernelLanes, sizeof(real));
+  for (int i = 0; i < numSpheres; i++) {
+    Surface* sphere = &scene->surfaces[scene->bvhIndices[i]];
+    spheres->x[i] = sphere->position[0];
+    spheres->y[i] = sphere->position[1];
+    spheres->z[i] = sphere->position[2];
+    spheres->radius[i] = sphere->radius;
+  }
+
+  PlaneArrays* planes = &scene->planes;
+  planes->x = calloc(scene->numPlanes + kernelLanes, sizeof(real));
+  planes->y = calloc(scene->numPlanes + kernelLanes, sizeof(real));
+  planes->z = calloc(scene->numPlanes + kernelLanes, sizeof(real));
+  planes->d = calloc(scene->numPlanes + kernelLanes, sizeof(real));
+  for (int i = 0; i < scene->numPlanes; i++) {
+    Surface* plane = &scene->surfaces[scene->planeIndices[i]];
+    planes->x[i] = plane->normal[0];
+    planes->y[i] = plane->normal[1];
+    planes->z[i] = plane->normal[2];
+    planes->d[i] = plane->d;
+  }
+}
+
+// fill in a BVH node holding count spheres starting at bvhIndices[first],
+// splitting it at the median along its longest axis until the leaves are small
+void build_bvh_node(Scene* scene, int node, int first, int count) {
+  BVHNode* n = &scene->bvhNodes[node];
+  real centerMin[3] = {INFINITY, INFINITY, INFINITY};
+  real centerMax[3] = {-INFINITY, -INFINITY, -INFINITY};
+  for (int axis = 0; axis < 3; axis++) {
+    n->min[axis] = INFINITY;
+    n->max[axis] = -INFINITY;
+  }
+  for (int i = first; i < first + count; i++) {
+    Surface* sphere = &scene->surfaces[scene->bvhIndices[i]];
+    for (int axis = 0; axis < 3; axis++) {
+      real c = sphere->position[axis];
+      real r = fabs(sphere->radius);
+      n->min[axis] = fmin(n->min[axis], c - r);
+      n->max[axis] = fmax(n->max[axis], c + r);
+      centerMin[axis] = fmin(centerMin[axis], c);
+      centerMax[axis] = fmax(centerMax[axis], c);
+    }
+  }
+  for (int axis = 0; axis < 3; axis++) { // pad the box so rounding never culls a grazing hit
+    real pad = epsilon + (fabs(n->min[axis]) + fabs(n->max[axis])) * boxPadding;
+    n->min[axis] -= pad;
+    n->max[axis] += pad;
+  }
+
+  if (count <= bvhLeafSize) { // small enough, make a leaf
+    n->first = first;
+    n->count = count;
+    return;
+  }
+
+  bvhSortAxis = 0;
+  for (int axis = 1; axis < 3; axis++) {
+    if (centerMax[axis] - centerMin[axis] > centerMax[bvhSortAxis] - centerMin[bvhSortAxis]) {
+      bvhSortAxis = axis;
+    }
+  }
+  bvhSortSurfaces = scene->surfaces;
+  qsort(&scene->bvhIndices[first], count, sizeof(int), compare_centroids);
+
+  int children = scene->numBVHNodes;
+  scene->numBVHNodes += 2;
+  n->first = children;
+  n->count = 0;
+  int half = count / 2;
+  build_bvh_node(scene, children, first, half);
+  build_bvh_node(scene, children + 1, first + half, count - half);
+}
+
+// qsort comparator ordering sphere indices by their center along bvhSortAxis
+int compare_centroids(const void* a, const void* b) {
+  real ca = bvhSortSurfaces[*(const int*)a].position[bvhSortAxis];
+  real cb = bvhSortSurfaces[*(const int*)b].position[bvhSortAxis];
+  if (ca < cb) return -1;
+  if (ca > cb) return 1;
+  return *(const int*)a - *(const int*)b;
+}
+
+// build the bounding volume hierarchy over the triangles of every mesh,
+// reordering scene->triangles into leaf order
+void build_mesh_bvh(Scene* scene) {
+  scene->meshNodes = NULL;
+  scene->numMeshNodes = 0;
+  if (scene->numTriangles == 0) return;
+
+  float* centroids = malloc(3 * sizeof(float) * scene->numTriangles); // centers of the triangles' boxes
+  for (int i = 0; i < scene->numTriangles; i++) {
+    uint32_t* v = scene->triangles[i].v;
+    for (int axis = 0; axis < 3; axis++) {
+      float a = scene->vertices[3 * v[0] + axis];
+      float b = scene->vertices[3 * v[1] + axis];
+      float c = scene->vertices[3 * v[2] + axis];
+      centroids[3 * i + axis] = (fminf(a, fminf(b, c)) + fmaxf(a, fmaxf(b, c))) * 0.5f;
+    }
+  }
+
+  // fewer than 2n nodes, as for the spheres, given back once the tree is built
+  scene->meshNodes = malloc(2 * sizeof(MeshNode) * scene->numTriangles);
+  scene->numMeshNodes = 1;
+  for (int axis = 0; axis < 3; axis++) {
+    scene->meshNodes[0].min[axis] = INFINITY;
+    scene->meshNodes[0].max[axis] = -INFINITY;
+  }
+  for (int i = 0; i < scene->numTriangles; i++) {
+    bound_triangle(scene, i, scene->meshNodes[0].min, scene->meshNodes[0].max);
+  }
+  build_mesh_node(scene, centroids, 0, 0, scene->numTriangles, 1);
+  free(centroids);
+  MeshNode* shrunk = realloc(scene->meshNodes, scene->numMeshNodes * sizeof(MeshNode));
+  if (shrunk != NULL) {
+    scene->meshNodes = shrunk;
+  }
+}
+
+// surface area of the box between min and max, 0 for an empty box
+float box_area(float* min, float* max) {
+  float dx = max[0] - min[0];
+  float dy = max[1] - min[1];
+  float dz = max[2] - min[2];
+  if (!(dx >= 0 && dy >= 0 && dz >= 0)) return 0;
+  return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+// grow the box between min and max to hold triangle i of the scene
+void bound_triangle(Scene* scene, int i, float* min, float* max) {
+  for (int corner = 0; corner < 3; corner++) {
+    float* vertex = &scene->vertices[3 * scene->triangles[i].v[corner]];
+    for (int axis = 0; axis < 3; axis++) {
+      min[axis] = fminf(min[axis], vertex[axis]);
+      max[axis] = fmaxf(max[axis], vertex[axis]);
+    }
+  }
+}
+
+// fill in a mesh BVH node holding count triangles starting at triangles[first],
+// whose box centers are in centroids, splitting it where the surface area
+// heuristic puts it among meshBins planes across its longest axis
+// The node's min and max already bound its triangles, the parent found them
+// while binning, and are padded here.
+void build_mesh_node(Scene* scene, float* centroids, int node, int first, int count, int depth) {
+  MeshNode* n = &scene->meshNodes[node];
+  float centerMin[3] = {INFINITY, INFINITY, INFINITY};
+  float centerMax[3] = {-INFINITY, -INFINITY, -INFINITY};
+  for (int i = first; i < first + count; i++) {
+    for (int axis = 0; axis < 3; axis++) {
+      centerMin[axis] = fminf(centerMin[axis], centroids[3 * i + axis]);
+      centerMax[axis] = fmaxf(centerMax[axis], centroids[3 * i + axis]);
+    }
+  }
+  for (int axis = 0; axis < 3; axis++) { // pad the box so rounding never culls a grazing hit
+    float pad = epsilon + (fabsf(n->min[axis]) + fabsf(n->max[axis])) * meshBoxPadding;
+    n->min[axis] -= pad;
+    n->max[axis] += pad;
+  }
+
+  // small enough, or as deep as the traversal stack allows, make a leaf
+  if (count <= meshLeafSize || depth >= bvhMaxDepth - 2) {
+    n->first = first;
+    n->count = count;
+    return;
+  }
+
+  int axis = 0;
+  for (int a = 1; a < 3; a++) {
+    if (centerMax[a] - centerMin[a] > centerMax[axis] - centerMin[axis]) {
+      axis = a;
+    }
+  }
+  float extent = centerMax[axis] - centerMin[axis];
+  int split = first + count / 2; // when every center is the same, split the triangles in half
+  int bestBin = -1; // the last bin on the left of the best split, if there is one
+  float leftMin[3], leftMax[3], rightMin[3], rightMax[3];
+
+  if (extent > 0) {
+    // count the triangles and bound them in each bin
+    int binCount[meshBins] = {0};
+    float binMin[meshBins][3];
+    float binMax[meshBins][3];
+    for (int b = 0; b < meshBins; b++) {
+      for (int a = 0; a < 3; a++) {
+        binMin[b][a] = INFINITY;
+        binMax[b][a] = -INFINITY;
+      }
+    }
+    float binScale = meshBins / extent;
+    for (int i = first; i < first + count; i++) {
+      int b = (int)((centroids[3 * i + axis] - centerMin[axis]) * binScale);
+      if (b >= meshBins) b = meshBins - 1;
+      binCount[b]++;
+      bound_triangle(scene, i, binMin[b], binMax[b]);
+    }
+
+    // sweep from the right for the cost of every right side, then from the
+    // left, keeping the split between bins with the least area times count
+    float rightCost[meshBins];
+    float rightBinMin[meshBins][3]; // bounds of every bin from b up
+    float rightBinMax[meshBins][3];
+    float min[3] = {INFINITY, INFINITY, INFINITY};
+    float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+    int rightCount = 0;
+    for (int b = meshBins - 1; b > 0; b--) {
+      rightCount += binCount[b];
+      for (int a = 0; a < 3; a++) {
+        min[a] = fminf(min[a], binMin[b][a]);
+        max[a] = fmaxf(max[a], binMax[b][a]);
+        rightBinMin[b][a] = min[a];
+        rightBinMax[b][a] = max[a];
+      }
+      rightCost[b] = box_area(min, max) * rightCount;
+    }
+    float bestCost = INFINITY;
+    int leftCount = 0;
+    for (int a = 0; a < 3; a++) {
+      min[a] = INFINITY;
+      max[a] = -INFINITY;
+    }
+    for (int b = 0; b < meshBins - 1; b++) {
+      leftCount += binCount[b];
+      for (int a = 0; a < 3; a++) {
+        min[a] = fminf(min[a], binMin[b][a]);
+        max[a] = fmaxf(max[a], binMax[b][a]);
+      }
+      if (leftCount == 0 || leftCount == count) continue;
+      float cost = box_area(min, max) * leftCount + rightCost[b + 1];
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestBin = b;
+        for (int a = 0; a < 3; a++) {
+          leftMin[a] = min[a];
+          leftMax[a] = max[a];
+          rightMin[a] = rightBinMin[b + 1][a];
+          rightMax[a] = rightBinMax[b + 1][a];
+        }
+      }
+    }
+
+    if (bestBin >= 0) { // move the triangles of the left bins to the front
+      int left = first;
+      int right = first + count - 1;
+      while (left <= right) {
+        int b = (int)((centroids[3 * left + axis] - centerMin[axis]) * binScale);
+        if (b >= meshBins) b = meshBins - 1;
+        if (b <= bestBin) {
+          left++;
+          continue;
+        }
+        MeshTriangle triangle = scene->triangles[left];
+        scene->triangles[left] = scene->triangles[right];
+        scene->triangles[right] = triangle;
+        for (int a = 0; a < 3; a++) {
+          float c = centroids[3 * left + a];
+          centroids[3 * left + a] = centroids[3 * right + a];
+          centroids[3 * right + a] = c;
+        }
+        right--;
+      }
+      split = left;
+    }
+  }
+
+  int children = scene->numMeshNodes;
+  scene->numMeshNodes += 2;
+  n->first = children;
+  n->count = 0;
+  MeshNode* left = &scene->meshNodes[children];
+  MeshNode* right = &scene->meshNodes[children + 1];
+  if (bestBin < 0) { // split in half, bound each half
+    for (int a = 0; a < 3; a++) {
+      left->min[a] = right->min[a] = INFINITY;
+      left->max[a] = right->max[a] = -INFINITY;
+    }
+    for (int i = first; i < split; i++) {
+      bound_triangle(scene, i, left->min, left->max);
+    }
+    for (int i = split; i < first + count; i++) {
+      bound_triangle(scene, i, right->min, right->max);
+    }
+  }
+  else {
+    memcpy(left->min, leftMin, sizeof(leftMin));
+    memcpy(left->max, leftMax, sizeof(leftMax));
+    memcpy(right->min, rightMin, sizeof(rightMin));
+    memcpy(right->max, rightMax, sizeof(rightMax));
+  }
+  build_mesh_node(scene, centroids, children, first, split - first, depth + 1);
+  build_mesh_node(scene, centroids, children + 1, split, first + count - split, depth + 1);
+}
+
+// make room in a growable object array for the object at index count,
+// doubling its capacity whenever it is full so that loading stays linear
+// Returns the (possibly moved) array, with the new slot zeroed
+Object* reserve_object(Object* objects, int count, int* capacity) {
+  if (count >= *capacity) {
+    int newCapacity = (*capacity < initialObjects) ? initialObjects : *capacity;
+    while (newCapacity <= count) {
+      if (newCapacity > INT_MAX / 2) {
+        fprintf(stderr, "Error: Too many objects in the scene, see line: %d.\n", line);
+        exit(1);
+      }
+      newCapacity *= 2;
+    }
+    objects = realloc(objects, (size_t)newCapacity * sizeof(Object));
+    if (objects == NULL) {
+      fprintf(stderr, "Error: Out of memory while reading object on line %d.\n", line);
+      exit(1);
+    }
+    *capacity = newCapacity;
+  }
+  memset(&objects[count], 0, sizeof(Object)); // unset attributes default to 0
+  return objects;
+}
+
+// shrink a growable object array down to exactly count objects
+// Returns the (possibly moved) array
+Object* shrink_objects(Object* objects, int count, int* capacity) {
+  if (count == 0 || count == *capacity) return objects;
+  Object* shrunk = realloc(objects, (size_t)count * sizeof(Object));
+  if (shrunk == NULL) return objects; // keeping the larger block is harmless
+  *capacity = count;
+  return shrunk;
+}
+
+// function to print out all the objects to stdout, for debugging
+void printObjs() {
+  for (int i = 0; i < numPhysicalObjects; i++) {
+    printf("Object %i: type = %i; position = [%lf, %lf, %lf]; color = [%lf, %lf, %lf]\n", i, physicalObjects[i].kind,
+    physicalObjects[i].position[0],
+    physicalObjects[i].position[1],
+    physicalObjects[i].position[2],
+    physicalObjects[i].color[0],
+    physicalObjects[i].color[1],
+    physicalObjects[i].color[2]);
+    if (physicalObjects[i].kind == 1) {
+      printf("  Radius = %lf\n", physicalObjects[i].sphere.radius);
+    }
+    else if (physicalObjects[i].kind == 0) {
+      printf("  Normal = [%lf, %lf, %lf]\n", physicalObjects[i].plane.normal[0], physicalObjects[i].plane.normal[1], physicalObjects[i].plane.normal[2]);
+    }
+    else if (physicalObjects[i].kind == 4) {
+      printf("  Scale = %lf; Triangles = %d\n", physicalObjects[i].mesh.scale, physicalObjects[i].mesh.numTriangles);
+    }
+  }
+  for (int i = 0; i < numLightObjects; i++) {
+    printf("Light Object %i: type = %i; position = [%lf, %lf, %lf]\n", i, lightObjects[i].kind,
+    lightObjects[i].position[0],
+    lightObjects[i].position[1],
+    lightObjects[i].position[2]);
+    printf("   A0: %lf; A1: %lf A2: %lf\n",
+    lightObjects[i].light.radialA0,
+    lightObjects[i].light.radialA1,
+    lightObjects[i].light.radialA2);
+  }
+  printf("Camera: type = %i\n", cameraObject.kind);
+}
+
+// function to print out the contents of pixmap to stdout, for debugging
+void printPixMap() {
+  size_t i = 0;
+  for (size_t y = 0; y < M; y++) {
+    for (size_t x = 0; x < N; x++) {
+      printf("[%i, %i, %i] ", pixmap[i].R, pixmap[i].G, pixmap[i].B); // print the pixel
+      i++;
+    }
+    printf("\n");
+  }
+}
+
+#ifdef ALLOC_STATS
+// Allocation counting wrappers, linked in with -Wl,--wrap=malloc and friends
+// so that every allocation this program makes passes through them
+void* __wrap_malloc(size_t size) {
+  if (countAllocations) __atomic_add_fetch(&renderAllocations, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+void* __wrap_calloc(size_t count, size_t size) {
+  if (countAllocations) __atomic_add_fetch(&renderAllocations, 1, __ATOMIC_RELAXED);
+  return __real_calloc(count, size);
+}
+void* __wrap_realloc(void* pointer, size_t size) {
+  if (countAllocations) __atomic_add_fetch(&renderAllocations, 1, __ATOMIC_RELAXED);
+  return __real_realloc(pointer, size);
+}
+
+// print the number of allocations made while rendering, registered with atexit()
+void report_allocations() {
+  fprintf(stderr, "Allocations during raycast(): %ld\n", renderAllocations);
+}
+#endif
+
+// Render the image band by band straight into a preallocated P6 file
+// Each band of streamRows rows is memory mapped from the file, rendered into
+// and unmapped again, so memory use is bounded by the band size rather than
+// by the size of the image
+void render_streaming(char* filename) {
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+
+  char header[ppmHeaderSize];
+  size_t headerLength = ppm_header(header, '6');
+  size_t rowBytes = N * sizeof(RGBpixel);
+  size_t fileBytes = headerLength + numPixels * sizeof(RGBpixel);
+
+  // reserve the whole file up front, so running out of disk fails here
+  // rather than as a fault in the middle of the render
+  int error = posix_fallocate(fd, 0, fileBytes);
+  if (error != 0 && ftruncate(fd, fileBytes) != 0) {
+    fprintf(stderr, "Error: Could not allocate %zu bytes for \"%s\"\n", fileBytes, filename);
+    exit(1);
+  }
+  if (pwrite(fd, header, headerLength, 0) != (ssize_t)headerLength) {
+    fprintf(stderr, "Error: Could not write the output image.\n");
+    exit(1);
+  }
+
+  size_t bandRows = streamRows;
+  if (bandRows == 0) { // pick a band size
+    bandRows = streamBandBytes / rowBytes;
+  }
+  if (bandRows < 1) bandRows = 1;
+
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  for (size_t row = 0; row < M; row += bandRows) {
+    size_t rows = (M - row < bandRows) ? M - row : bandRows;
+    size_t offset = headerLength + row * rowBytes;
+    size_t mapOffset = offset - offset % pageSize; // mmap offsets must be page aligned
+    size_t mapLength = offset - mapOffset + rows * rowBytes;
+
+    char* band = mmap(NULL, mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mapOffset);
+    if (band == MAP_FAILED) {
+      fprintf(stderr, "Error: Could not map rows %zu to %zu of \"%s\"\n", row, row + rows, filename);
+      exit(1);
+    }
+    pixmap = (RGBpixel*)(band + (offset - mapOffset));
+    double raycastStart = seconds_now();
+    raycast_band(row, row + rows);
+    double writeStart = seconds_now();
+    raycastSeconds += writeStart - raycastStart;
+    munmap(band, mapLength); // hands the finished band back to the kernel to write out
+    writeSeconds += seconds_now() - writeStart;
+  }
+  pixmap = NULL;
+  close(fd);
+}
+
+// render the image in passes over ever finer pixel lattices, starting with
+// one pixel in every step by step block, and write a preview to filename
+// after each pass. Each pass traces only the lattice points no earlier pass
+// traced and fills every other pixel from the traced point above and to the
+// left of it, so the last pass leaves exactly the normal render.
+void render_progressive(char* filename, size_t step) {
+  pixmap = malloc(sizeof(RGBpixel) * numPixels);
+  if (pixmap == NULL) {
+    fprintf(stderr, "Error: Not enough memory for a %zu by %zu image.\n", N, M);
+    exit(1);
+  }
+  char* tempName = malloc(strlen(filename) + 5);
+  sprintf(tempName, "%s.tmp", filename);
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  tracedStep = 0;
+  for (passStep = step; passStep >= 1; passStep /= 2) {
+    double raycastStart = seconds_now();
+    raycast();
+    if (passStep == 1 && aaThreshold >= 0) antialias(); // the final image
+
+    if (passStep > 1) { // fill the gaps between the lattice points
+      for (size_t y = 0; y < M; y++) {
+        RGBpixel* row = &pixmap[y * N];
+        RGBpixel* source = &pixmap[(y - y % passStep) * N];
+        for (size_t x = 0; x < N; x++) {
+          row[x] = source[x - x % passStep];
+        }
+      }
+    }
+
+    double writeStart = seconds_now();
+    raycastSeconds += writeStart - raycastStart;
+
+    replace_image(tempName, filename);
+    writeSeconds += seconds_now() - writeStart;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("Pass with 1 in %zu pixels written after %.3f s\n", passStep * passStep,
+      (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9);
+    fflush(stdout);
+    tracedStep = passStep;
+  }
+  passStep = 1;
+  tracedStep = 0;
+  free(tempName);
+  if (aaThreshold >= 0) report_antialiasing();
+}
+
+// write pixmap to tempName, then rename it over filename to replace the
+// previous image in one step, so viewers never see half a file
+void replace_image(char* tempName, char* filename) {
+  FILE* fh = fopen(tempName, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", tempName);
+    exit(1);
+  }
+  if (outputFormat == '6') {
+    writeP6(fh);
+  }
+  else {
+    writeP3(fh);
+  }
+  if (rename(tempName, filename) != 0) {
+    fprintf(stderr, "Error: Could not write file \"%s\"\n", filename);
+    exit(1);
+  }
+}
+
+// parse an animation file, a json list of keyframes such as
+//   { "frame": 0, "camera": [0, 0, 0] }
+//   { "frame": 60, "object": 2, "translate": [1, 0, 0] }
+//   { "frame": 60, "light": 0, "translate": [0, 2, 0] }
+// Objects and lights are numbered from 0 in the order the scene lists them
+void read_animation(char* filename, Scene* scene) {
+  int c;
+  JsonInput input;
+  JsonInput* json = &input;
+  map_json(filename, json);
+  numFrames = 0;
+
+  skip_ws(json);
+  expect_c(json, '[');
+  skip_ws(json);
+  if (json->pos < json->end && *json->pos == ']') {
+    fprintf(stderr, "Error: The animation \"%s\" has no keyframes.\n", filename);
+    exit(1);
+  }
+
+  while (1) { // read each keyframe
+    expect_c(json, '{');
+    skip_ws(json);
+    int frame = -1;
+    int target = -1;
+    int index = 0;
+    int hasValue = 0;
+    real value[3];
+    int keyLine = line;
+
+    while (1) { // read each field of the keyframe
+      Token key = next_string(json);
+      skip_ws(json);
+      expect_c(json, ':');
+      skip_ws(json);
+      if (token_equal(key, "frame")) {
+        real number = next_number(json);
+        if (number < 0 || number > INT_MAX - 1 || number != (int)number) {
+          fprintf(stderr, "Error: Frame numbers must be whole and not negative, see line %d.\n", line);
+          exit(1);
+        }
+        frame = (int)number;
+      }
+      else if (token_equal(key, "camera")) {
+        target = trackCamera;
+        next_vector(json, value);
+        hasValue = 1;
+      }
+      else if (token_equal(key, "object") || token_equal(key, "light")) {
+        target = token_equal(key, "object") ? trackSurface : trackLight;
+        real number = next_number(json);
+        int count = (target == trackSurface) ? scene->numSurfaces : scene->numLights;
+        if (number < 0 || number >= count || number != (int)number) {
+          fprintf(stderr, "Error: There is no %.*s %g in the scene, see line %d.\n", (int)key.length, key.start, number, line);
+          exit(1);
+        }
+        index = (int)number;
+        if (target == trackSurface && scene->surfaces[index].kind == 4) {
+          fprintf(stderr, "Error: Object %d is a mesh, which can not be animated, see line %d.\n", index, line);
+          exit(1);
+        }
+      }
+      else if (token_equal(key, "translate")) {
+        next_vector(json, value);
+        hasValue = 1;
+      }
+      else {
+        fprintf(stderr, "Error: Unknown keyframe property, \"%.*s\", on line %d.\n", (int)key.length, key.start, line);
+        exit(1);
+      }
+      skip_ws(json);
+      c = next_c(json);
+      if (c == '}') break;
+      if (c != ',') {
+        fprintf(stderr, "Error: Expecting ',' or '}' on line %d.\n", line);
+        exit(1);
+      }
+      skip_ws(json);
+    }
+
+    if (frame < 0 || target < 0 || !hasValue) {
+      fprintf(stderr, "Error: The keyframe on line %d needs a frame, a target and a value.\n", keyLine);
+      exit(1);
+    }
+
+    // insert the keyframe into its track, keeping the keys sorted by frame
+    Track* track = find_track(scene, target, index);
+    if (track->numKeys == track->capacity) {
+      track->capacity = (track->capacity == 0) ? 4 : track->capacity * 2;
+      track->keys = realloc(track->keys, track->capacity * sizeof(Keyframe));
+    }
+    int k = track->numKeys++;
+    while (k > 0 && track->keys[k - 1].frame > frame) {
+      track->keys[k] = track->keys[k - 1];
+      k--;
+    }
+    if (k > 0 && track->keys[k - 1].frame == frame) {
+      fprintf(stderr, "Error: Frame %d is keyed twice for the same target, see line %d.\n", frame, keyLine);
+      exit(1);
+    }
+    track->keys[k].frame = frame;
+    memcpy(track->keys[k].value, value, sizeof(value));
+    if (frame >= numFrames) numFrames = frame + 1;
+
+    skip_ws(json);
+    c = next_c(json);
+    if (c == ']') break;
+    if (c != ',') {
+      fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
+      exit(1);
+    }
+    skip_ws(json);
+  }
+
+  if (input.data != NULL) {
+    munmap(input.data, input.end - input.data);
+  }
+}
+
+// get the track animating the camera, a surface or a light, adding it if the
+// animation does not have one yet
+Track* find_track(Scene* scene, int target, int index) {
+  for (int i = 0; i < numTracks; i++) {
+    if (tracks[i].target == target && tracks[i].index == index) return &tracks[i];
+  }
+
+  tracks = realloc(tracks, (numTracks + 1) * sizeof(Track));
+  Track* track = &tracks[numTracks++];
+  memset(track, 0, sizeof(Track));
+  track->target = target;
+  track->index = index;
+  if (target == trackSurface) {
+    Surface* surface = &scene->surfaces[index];
+    memcpy(track->base, surface->position, sizeof(track->base));
+    int* slots = (surface->kind == 1) ? scene->bvhIndices : scene->planeIndices;
+    int count = (surface->kind == 1) ? scene->numSpheres : scene->numPlanes;
+    for (int i = 0; i < count; i++) {
+      if (slots[i] == index) track->slot = i;
+    }
+  }
+  else if (target == trackLight) {
+    memcpy(track->base, scene->lights[index].position, sizeof(track->base));
+  }
+  return track;
+}
+
+// get the value of a track at frame, interpolating between its keyframes
+void track_value(Track* track, int frame, real* value) {
+  Keyframe* keys = track->keys;
+  int last = track->numKeys - 1;
+  if (frame <= keys[0].frame) {
+    memcpy(value, keys[0].value, 3 * sizeof(real));
+    return;
+  }
+  if (frame >= keys[last].frame) {
+    memcpy(value, keys[last].value, 3 * sizeof(real));
+    return;
+  }
+  int k = 1;
+  while (keys[k].frame < frame) k++;
+  real s = (real)(frame - keys[k - 1].frame) / (keys[k].frame - keys[k - 1].frame);
+  for (int i = 0; i < 3; i++) {
+    value[i] = keys[k - 1].value[i] + (keys[k].value[i] - keys[k - 1].value[i]) * s;
+  }
+}
+
+// move the camera, surfaces and lights of scene to where they are at frame
+// The kernel arrays are updated in place and the BVH is refit rather than
+// rebuilt, so every frame reuses the structures compiled from the scene
+void animate_frame(Scene* scene, int frame) {
+  int movedSpheres = 0;
+  for (int i = 0; i < numTracks; i++) {
+    Track* track = &tracks[i];
+    real value[3];
+    track_value(track, frame, value);
+    if (track->target == trackCamera) {
+      memcpy(scene->cameraPosition, value, sizeof(scene->cameraPosition));
+    }
+    else if (track->target == trackLight) {
+      v3_add(track->base, value, scene->lights[track->index].position);
+    }
+    else {
+      Surface* surface = &scene->surfaces[track->index];
+      v3_add(track->base, value, surface->position);
+      if (surface->kind == 1) { // sphere
+        scene->spheres.x[track->slot] = surface->position[0];
+        scene->spheres.y[track->slot] = surface->position[1];
+        scene->spheres.z[track->slot] = surface->position[2];
+        movedSpheres = 1;
+      }
+      else { // plane
+        surface->d = -v3_dot(surface->normal, surface->position);
+        scene->planes.d[track->slot] = surface->d;
+      }
+    }
+  }
+  if (movedSpheres) refit_bvh(scene);
+}
+
+// recompute the boxes of the BVH around the spheres' current positions,
+// keeping its shape. Children always follow their parent in bvhNodes, so
+// walking the nodes backwards visits the children first.
+void refit_bvh(Scene* scene) {
+  for (int node = scene->numBVHNodes - 1; node >= 0; node--) {
+    BVHNode* n = &scene->bvhNodes[node];
+    if (n->count > 0) { // leaf, bound its spheres
+      for (int axis = 0; axis < 3; axis++) {
+        n->min[axis] = INFINITY;
+        n->max[axis] = -INFINITY;
+      }
+      for (int i = n->first; i < n->first + n->count; i++) {
+        Surface* sphere = &scene->surfaces[scene->bvhIndices[i]];
+        for (int axis = 0; axis < 3; axis++) {
+          real c = sphere->position[axis];
+          real r = fabs(sphere->radius);
+          n->min[axis] = fmin(n->min[axis], c - r);
+          n->max[axis] = fmax(n->max[axis], c + r);
+        }
+      }
+      for (int axis = 0; axis < 3; axis++) { // same padding as build_bvh_node()
+        real pad = epsilon + (fabs(n->min[axis]) + fabs(n->max[axis])) * boxPadding;
+        n->min[axis] -= pad;
+        n->max[axis] += pad;
+      }
+    }
+    else { // bound both children
+      BVHNode* left = &scene->bvhNodes[n->first];
+      BVHNode* right = &scene->bvhNodes[n->first + 1];
+      for (int axis = 0; axis < 3; axis++) {
+        n->min[axis] = fmin(left->min[axis], right->min[axis]);
+        n->max[axis] = fmax(left->max[axis], right->max[axis]);
+      }
+    }
+  }
+}
+
+// render every frame of the animation into files named after pattern, whose
+// last run of '#' is replaced by the zero padded frame number
+// The scene, pixmap, tiles and BVH are shared by all of the frames.
+void render_animation(char* pattern) {
+  size_t nameSize = strlen(pattern) + 16;
+  char* name = malloc(nameSize);
+  if (!frame_filename(pattern, 0, name, nameSize)) {
+    fprintf(stderr, "Error: The output name \"%s\" needs a run of '#' for the frame number.\n", pattern);
+    exit(1);
+  }
+  char frameFormat = (outputFormat != 0) ? outputFormat : format_from_filename(pattern);
+
+  pixmap = malloc(sizeof(RGBpixel) * numPixels);
+  if (pixmap == NULL) {
+    fprintf(stderr, "Error: Not enough memory for a %zu by %zu image.\n", N, M);
+    exit(1);
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int frame = 0; frame < numFrames; frame++) {
+    double raycastStart = seconds_now();
+    animate_frame(&compiledScene, frame);
+    raycast();
+    if (aaThreshold >= 0) antialias();
+    double writeStart = seconds_now();
+    raycastSeconds += writeStart - raycastStart;
+
+    frame_filename(pattern, frame, name, nameSize);
+    FILE* fh = fopen(name, "wb");
+    if (fh == NULL) {
+      fprintf(stderr, "Error: Could not open file \"%s\"\n", name);
+      exit(1);
+    }
+    if (frameFormat == '6') {
+      writeP6(fh);
+    }
+    else {
+      writeP3(fh); // both close fh
+    }
+    writeSeconds += seconds_now() - writeStart;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Rendered %d frames of %zu by %zu in %.3f s, %.2f frames per second\n",
+    numFrames, N, M, elapsed, numFrames / elapsed);
+  if (aaThreshold >= 0) report_antialiasing();
+  free(name);
+}
+
+// write the output file name of frame into name, replacing the last run of
+// '#' in pattern with the frame number padded to the length of the run
+// Returns 0 if pattern has no '#'
+int frame_filename(char* pattern, int frame, char* name, size_t size) {
+  char* runEnd = strrchr(pattern, '#');
+  if (runEnd == NULL) return 0;
+  char* runStart = runEnd;
+  while (runStart > pattern && runStart[-1] == '#') runStart--;
+  snprintf(name, size, "%.*s%0*d%s", (int)(runStart - pattern), pattern,
+    (int)(runEnd - runStart + 1), frame, runEnd + 1);
+  return 1;
+}
+
+// monotonic clock reading in seconds, for timing the phases of a render
+double seconds_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// write the phase timings and merged counters of the render as one line of
+// json to filename, or to stdout if it is "-"
+void write_stats(char* filename, char* sceneName) {
+  FILE* fh = (strcmp(filename, "-") == 0) ? stdout : fopen(filename, "w");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+  fprintf(fh, "{\"scene\": \"");
+  for (char* c = sceneName; *c != 0; c++) {
+    if (*c == '"' || *c == '\\') fputc('\\', fh);
+    fputc(*c, fh);
+  }
+  RenderStats* stats = &renderStats;
+  fprintf(fh, "\", \"real\": \"%s\", \"width\": %zu, \"height\": %zu, \"frames\": %d, \"threads\": %d, "
+    "\"surfaces\": %d, \"lights\": %d, ",
+    realName, N, M, (animationName != NULL) ? numFrames : 1, numThreads,
+    compiledScene.numSurfaces, compiledScene.numLights);
+  fprintf(fh, "\"packet\": %d, \"light_cutoff\": %g, ", packetSize, lightCutoff);
+  fprintf(fh, "\"seconds\": {\"read_scene\": %.6f, \"raycast\": %.6f, \"write\": %.6f}, ",
+    loadSeconds, raycastSeconds, writeSeconds);
+  fprintf(fh, "\"primary_rays\": %llu, \"shadow_rays\": %llu, \"shadow_blocked\": %llu, "
+    "\"shadow_occluder_hits\": %llu, \"primitive_tests\": %llu, \"box_tests\": %llu, "
+    "\"lit_pixels\": %llu, \"background_pixels\": %llu, \"refined_pixels\": %llu, "
+    "\"packets\": %llu, \"split_packets\": %llu, \"culled_lights\": %llu}\n",
+    (unsigned long long)stats->primaryRays, (unsigned long long)stats->shadowRays,
+    (unsigned long long)stats->shadowBlocked, (unsigned long long)stats->occluderHits,
+    (unsigned long long)stats->primitiveTests, (unsigned long long)stats->boxTests,
+    (unsigned long long)stats->litPixels, (unsigned long long)stats->backgroundPixels,
+    (unsigned long long)stats->refinedPixels, (unsigned long long)stats->packets,
+    (unsigned long long)stats->splitPackets, (unsigned long long)stats->culledLights);
+  if (fh != stdout) fclose(fh);
+}
+
+// parse a positive image dimension from the command line
+size_t parse_dimension(char* text, char* name) {
+  char* end;
+  errno = 0;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (text[0] == '-' || end == text || *end != 0 || errno != 0 || value == 0) {
+    fprintf(stderr, "Error: The %s must be a positive whole number of pixels, not \"%s\".\n", name, text);
+    exit(1);
+  }
+  return (size_t)value;
+}
+
+// parse x0,y0,x1,y1 into region, returns 0 unless it is a rectangle
+// inside a width by height frame
+int parse_region(char* text, size_t width, size_t height) {
+  int length = 0;
+  return sscanf(text, "%zu,%zu,%zu,%zu%n", &region[0], &region[1], &region[2], &region[3], &length) == 4 &&
+    text[length] == 0 && strchr(text, '-') == NULL && region[0] < region[2] && region[1] < region[3] &&
+    region[2] <= width && region[3] <= height;
+}
+
+// make pixmap cover only the region of the N by M frame. Antialiasing looks
+// at the neighbors of every pixel, so it gets a one pixel apron around the
+// region, which crop_region() drops again.
+void setup_region() {
+  size_t apron = (aaThreshold >= 0) ? 1 : 0;
+  bufferLeft = (region[0] >= apron) ? region[0] - apron : 0;
+  bufferTop = (region[1] >= apron) ? region[1] - apron : 0;
+  size_t bufferRight = (region[2] + apron <= N) ? region[2] + apron : N;
+  size_t bufferBottom = (region[3] + apron <= M) ? region[3] + apron : M;
+  N = bufferRight - bufferLeft;
+  M = bufferBottom - bufferTop;
+  numPixels = N * M;
+  useRegion = 1;
+}
+
+// drop the antialiasing apron from pixmap, leaving exactly the region
+void crop_region() {
+  size_t width = region[2] - region[0];
+  size_t height = region[3] - region[1];
+  size_t left = region[0] - bufferLeft;
+  size_t top = region[1] - bufferTop;
+  for (size_t y = 0; y < height; y++) {
+    memmove(&pixmap[y * width], &pixmap[(y + top) * N + left], width * sizeof(RGBpixel));
+  }
+  N = width;
+  M = height;
+  numPixels = N * M;
+}
+
+// parse x,y,z into position, returns 0 unless it is three numbers
+int parse_camera(char* text, real* position) {
+  double values[3];
+  int length = 0;
+  if (sscanf(text, "%lf,%lf,%lf%n", &values[0], &values[1], &values[2], &length) != 3 || text[length] != 0) {
+    return 0;
+  }
+  for (int i = 0; i < 3; i++) {
+    position[i] = values[i];
+  }
+  return 1;
+}
+
+// Serve renders on the Unix socket socketName until killed. Each connection
+// gets a thread that answers its requests, one per line:
+//   scene LENGTH, followed by LENGTH bytes of scene json
+//     answered with "ok ID", ID being the hash of the json
+//   render ID WIDTH HEIGHT [camera X,Y,Z] [region X0,Y0,X1,Y1]
+//     answered with "image LENGTH" and LENGTH bytes of P6 image
+// or with "error MESSAGE" when a request fails. Scenes are compiled into
+// socketName.scenes and named by their hash, so a scene sent again, or after
+// a restart, is not parsed again. Jobs from every connection take turns on
+// the one pool of render threads, each job using all of them.
+int run_daemon(char* socketName) {
+  struct sockaddr_un address;
+  struct stat info;
+  if (!unix_address(socketName, &address)) {
+    fprintf(stderr, "Error: The socket name \"%s\" is too long.\n", socketName);
+    exit(1);
+  }
+  if (snprintf(sceneDirectory, sizeof(sceneDirectory), "%s.scenes", socketName) >= (int)sizeof(sceneDirectory) ||
+      (mkdir(sceneDirectory, 0755) != 0 && errno != EEXIST)) {
+    fprintf(stderr, "Error: Could not create the scene directory \"%s.scenes\"\n", socketName);
+    exit(1);
+  }
+  if (lstat(socketName, &info) == 0 && S_ISSOCK(info.st_mode)) {
+    unlink(socketName); // left behind by an earlier daemon
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+    fprintf(stderr, "Error: Could not listen on \"%s\"\n", socketName);
+    exit(1);
+  }
+  fcntl(listener, F_SETFD, FD_CLOEXEC); // not inherited by the scene compiler
+  signal(SIGPIPE, SIG_IGN); // a client hanging up mid image must not end the daemon
+  select_kernels(); // once, every scene is rendered with the same kernels
+  printf("Listening on %s with %d render threads\n", socketName, numThreads);
+  fflush(stdout);
+
+  while (1) {
+    int client = accept(listener, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      fprintf(stderr, "Error: Could not accept a connection on \"%s\"\n", socketName);
+      exit(1);
+    }
+    fcntl(client, F_SETFD, FD_CLOEXEC);
+    int* arg = malloc(sizeof(int));
+    *arg = client;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_client, arg) != 0) {
+      close(client);
+      free(arg);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+// Connection thread of the daemon, answers requests until the client hangs up
+void* serve_client(void* arg) {
+  int fd = *(int*)arg;
+  free(arg);
+  FILE* in = fdopen(fd, "r");
+  if (in == NULL) {
+    close(fd);
+    return NULL;
+  }
+  char request[daemonLineSize];
+  while (fgets(request, sizeof(request), in) != NULL) {
+    if (strchr(request, '\n') == NULL) {
+      reply_error(fd, "request line too long");
+      break;
+    }
+    if (strncmp(request, "scene ", 6) == 0) {
+      if (!daemon_scene(fd, in, request)) break;
+    }
+    else if (strncmp(request, "render ", 7) == 0) {
+      daemon_render(fd, request);
+    }
+    else {
+      reply_error(fd, "unknown request");
+    }
+  }
+  fclose(in); // closes fd
+  return NULL;
+}
+
+// Answer a scene request, compiling the json that follows it unless a scene
+// with the same hash is already known. The compiler runs as a child process,
+// as the json parser exits on errors. Relative mesh file names are found in
+// the directory the request names after the length, and refused without one.
+// Returns 0 if the connection is unusable.
+int daemon_scene(int fd, FILE* in, char* request) {
+  size_t length;
+  int end = 0;
+  if (sscanf(request, "scene %zu%n", &length, &end) != 1 || (request[end] != '\n' && request[end] != ' ') ||
+      length > daemonMaxSceneBytes) { // negative lengths wrap around to huge ones
+    reply_error(fd, "expected scene LENGTH [DIRECTORY], at most 1 GB");
+    return 0; // the scene data can not be skipped
+  }
+  char* meshDir = ""; // no directory, relative mesh file names are errors
+  if (request[end] == ' ') {
+    meshDir = request + end + 1; // the rest of the line, it may hold spaces
+    meshDir[strcspn(meshDir, "\n")] = 0;
+    if (meshDir[0] != '/') {
+      reply_error(fd, "expected scene LENGTH [DIRECTORY], with an absolute DIRECTORY");
+      return 0;
+    }
+  }
+  char* json = malloc(length + 1);
+  if (json == NULL || fread(json, 1, length, in) != length) {
+    free(json);
+    return 0;
+  }
+  char key[17];
+  uint64_t hash = hash_bytes(0, json, length);
+  sprintf(key, "%016llx", (unsigned long long)hash_bytes(hash, meshDir, strlen(meshDir)));
+
+  CachedScene* cached = find_upload(key);
+  if (cached == NULL) { // a new scene, or its compiled file is out of date
+    char jsonName[PATH_MAX + 32];
+    char cacheName[PATH_MAX + 32];
+    sprintf(jsonName, "%s/%s.json", sceneDirectory, key);
+    sprintf(cacheName, "%s/%s.rsc", sceneDirectory, key);
+    pthread_mutex_lock(&compileLock);
+    FILE* fh = fopen(jsonName, "wb");
+    int compiled = fh != NULL && fwrite(json, 1, length, fh) == length;
+    if (fh != NULL && fclose(fh) != 0) compiled = 0;
+    if (compiled) compiled = compile_child(jsonName, cacheName, meshDir);
+    pthread_mutex_unlock(&compileLock);
+    if (compiled) cached = find_upload(key);
+  }
+  free(json);
+  if (cached == NULL) {
+    reply_error(fd, "the scene did not compile, see the daemon's output");
+    return 1;
+  }
+  char reply[32];
+  int replyLength = sprintf(reply, "ok %s\n", cached->id); // pinned, so the id stays
+  release_scene(cached);
+  return send_bytes(fd, reply, replyLength);
+}
+
+// Compile jsonName into cacheName in a child process, so a scene that does
+// not parse exits the child instead of this process. Relative mesh file names
+// are found in meshDir, or next to jsonName when it is NULL, see --mesh-dir.
+// Returns 1 if the child succeeded
+int compile_child(char* jsonName, char* cacheName, char* meshDir) {
+  extern char** environ;
+  char* compiler[7];
+  int count = 0;
+  compiler[count++] = "/proc/self/exe";
+  if (meshDir != NULL) { // first, --compile runs as soon as it is read
+    compiler[count++] = "--mesh-dir";
+    compiler[count++] = meshDir;
+  }
+  compiler[count++] = "--compile";
+  compiler[count++] = jsonName;
+  compiler[count++] = cacheName;
+  compiler[count] = NULL;
+  pid_t child;
+  int status;
+  return posix_spawn(&child, compiler[0], NULL, NULL, compiler, environ) == 0 &&
+    waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Answer a render request with a P6 image of the scene. Jobs take turns
+// owning pixmap, N, M and the rest of the render state, and lend their scene,
+// with its camera moved if asked, to the render threads as compiledScene.
+void daemon_render(int fd, char* request) {
+  char id[17];
+  size_t width, height;
+  int end = 0;
+  if (sscanf(request, "render %16s %zu %zu%n", id, &width, &height, &end) != 3 ||
+      width == 0 || height == 0 || width > daemonMaxPixels / height) {
+    reply_error(fd, "expected render ID WIDTH HEIGHT [camera X,Y,Z] [region X0,Y0,X1,Y1]");
+    return;
+  }
+  int hasCamera = 0;
+  real camera[3];
+  char* regionText = NULL;
+  char* save;
+  for (char* word = strtok_r(request + end, " \n", &save); word != NULL; word = strtok_r(NULL, " \n", &save)) {
+    char* value = strtok_r(NULL, " \n", &save);
+    if (value != NULL && strcmp(word, "camera") == 0 && parse_camera(value, camera)) {
+      hasCamera = 1;
+    }
+    else if (value != NULL && strcmp(word, "region") == 0) {
+      regionText = value;
+    }
+    else {
+      reply_error(fd, "expected render ID WIDTH HEIGHT [camera X,Y,Z] [region X0,Y0,X1,Y1]");
+      return;
+    }
+  }
+  CachedScene* cached = find_scene(id);
+  if (cached == NULL) {
+    reply_error(fd, "unknown scene, send it first");
+    return;
+  }
+
+  pthread_mutex_lock(&renderLock);
+  compiledScene = cached->scene;
+  if (hasCamera) {
+    memcpy(compiledScene.cameraPosition, camera, sizeof(camera));
+  }
+  N = width;
+  M = height;
+  numPixels = N * M;
+  imageWidth = N;
+  imageHeight = M;
+  char* error = NULL;
+  if (regionText != NULL) {
+    if (parse_region(regionText, N, M)) setup_region();
+    else error = "the region is not inside the image";
+  }
+  if (error == NULL) {
+    pixmap = malloc(numPixels * sizeof(RGBpixel));
+    if (aaThreshold >= 0) hitBuffer = malloc(numPixels * sizeof(int));
+    if (pixmap == NULL || (aaThreshold >= 0 && hitBuffer == NULL)) error = "not enough memory for the image";
+  }
+  RGBpixel* image = NULL;
+  char header[ppmHeaderSize];
+  size_t headerLength = 0;
+  if (error == NULL) {
+    raycast();
+    if (aaThreshold >= 0) antialias();
+    if (useRegion) crop_region();
+    headerLength = ppm_header(header, '6');
+    image = pixmap;
+  }
+  else {
+    free(pixmap);
+  }
+  pixmap = NULL;
+  free(hitBuffer); // sized for this image
+  hitBuffer = NULL;
+  free(aaMask);
+  aaMask = NULL;
+  useRegion = 0;
+  bufferLeft = 0;
+  bufferTop = 0;
+  size_t pixelBytes = numPixels * sizeof(RGBpixel);
+  memset(&compiledScene, 0, sizeof(Scene)); // only lent by the cache
+  pthread_mutex_unlock(&renderLock);
+  release_scene(cached);
+
+  if (error != NULL) {
+    reply_error(fd, error);
+    return;
+  }
+  char reply[64];
+  int replyLength = sprintf(reply, "image %zu\n", headerLength + pixelBytes);
+  if (send_bytes(fd, reply, replyLength) && send_bytes(fd, header, headerLength)) {
+    send_bytes(fd, image, pixelBytes);
+  }
+  free(image);
+}
+
+// Returns the scene named id, loading its compiled file from sceneDirectory
+// if it is not loaded yet, or NULL if there is none. When every slot is
+// taken the least recently used scene nobody is rendering makes room. The
+// caller hands the scene back with release_scene().
+// sceneLock is only held to look at the slots: a scene in use is pinned by
+// its users count, so evicting and loading never touch what a render is
+// reading, and lookups wait neither for the render running under renderLock
+// nor for a scene being loaded or compiled.
+CachedScene* find_scene(char* id) {
+  pthread_mutex_lock(&sceneLock);
+  daemonClock++;
+  CachedScene* found = NULL;
+  for (int i = 0; i < daemonScenes; i++) {
+    if (!daemonCache[i].loading && strcmp(daemonCache[i].id, id) == 0) found = &daemonCache[i];
+  }
+  if (found != NULL) {
+    found->lastUsed = daemonClock;
+    found->users++;
+  }
+  pthread_mutex_unlock(&sceneLock);
+  if (found != NULL) return found;
+
+  found = load_slot(id, ""); // only a scene without meshes is stored under its id
+  if (found != NULL && found->scene.numMeshSources > 0) { // stored under the key it was uploaded as
+    drop_slot(found);
+    return NULL;
+  }
+  if (found != NULL) {
+    pthread_mutex_lock(&sceneLock);
+    strcpy(found->id, id);
+    strcpy(found->key, id); // which for a scene without meshes is its key
+    found->loading = 0;
+    pthread_mutex_unlock(&sceneLock);
+  }
+  return found;
+}
+
+// Returns the scene uploaded as key, pinned like find_scene(), loading its
+// compiled file if it is not loaded yet, or NULL if there is none or it is
+// out of date, which daemon_scene() then compiles. A loaded scene whose OBJ
+// files have changed since is no longer found by key, but keeps its id for
+// the renders already asked for by it. The id of the scene is key with the
+// hashes of its OBJ files added, so the same json gets a new id once an OBJ
+// file changes, and a scene without meshes is named key.
+CachedScene* find_upload(char* key) {
+  pthread_mutex_lock(&sceneLock);
+  daemonClock++;
+  CachedScene* found = NULL;
+  for (int i = 0; i < daemonScenes; i++) {
+    if (!daemonCache[i].loading && strcmp(daemonCache[i].key, key) == 0) found = &daemonCache[i];
+  }
+  if (found != NULL) {
+    found->lastUsed = daemonClock;
+    found->users++;
+  }
+  pthread_mutex_unlock(&sceneLock);
+  if (found != NULL) {
+    if (mesh_sources_current(&found->scene)) return found; // checked pinned, as it may hash an OBJ file
+    pthread_mutex_lock(&sceneLock);
+    if (strcmp(found->key, key) == 0) found->key[0] = 0;
+    found->users--;
+    pthread_mutex_unlock(&sceneLock);
+  }
+
+  found = load_slot(key, NULL); // load_scene_cache() checks the OBJ files too
+  if (found != NULL) {
+    uint64_t hash = strtoull(key, NULL, 16);
+    for (int i = 0; i < found->scene.numMeshSources; i++) {
+      hash = hash_bytes(hash, &found->scene.meshSources[i].hash, sizeof(uint64_t));
+    }
+    pthread_mutex_lock(&sceneLock);
+    sprintf(found->id, "%016llx", (unsigned long long)hash);
+    strcpy(found->key, key);
+    found->loading = 0;
+    pthread_mutex_unlock(&sceneLock);
+  }
+  return found;
+}
+
+// Load sceneDirectory/name.rsc into the least recently used slot nobody is
+// rendering, compiling it again from name.json first if it is out of date,
+// with relative mesh file names found in meshDir, unless meshDir is NULL.
+// The slot is claimed under
+// sceneLock, pinned and marked loading so no lookup finds or evicts it, and
+// filled without sceneLock, so lookups of other scenes never wait for it.
+// Returns the slot, pinned for the caller, who names it and clears loading,
+// or NULL if every slot is in use or the scene is not compiled or does not
+// compile
+CachedScene* load_slot(char* name, char* meshDir) {
+  char jsonName[PATH_MAX + 32];
+  char cacheName[PATH_MAX + 32];
+  sprintf(jsonName, "%s/%s.json", sceneDirectory, name);
+  sprintf(cacheName, "%s/%s.rsc", sceneDirectory, name);
+  if (access(cacheName, R_OK) != 0) return NULL;
+
+  pthread_mutex_lock(&sceneLock);
+  CachedScene* oldest = NULL;
+  for (int i = 0; i < daemonScenes; i++) {
+    CachedScene* cached = &daemonCache[i];
+    if (cached->users == 0 && (oldest == NULL || cached->lastUsed < oldest->lastUsed)) oldest = cached;
+  }
+  if (oldest != NULL) {
+    oldest->users = 1;
+    oldest->loading = 1;
+    oldest->lastUsed = daemonClock;
+  }
+  pthread_mutex_unlock(&sceneLock);
+  if (oldest == NULL) return NULL;
+
+  free_scene(&oldest->scene); // nothing to free in a slot never used
+  int loaded = load_scene_cache(cacheName, &oldest->scene);
+  if (!loaded && meshDir != NULL) { // out of date, compiled in a child so a bad scene can not end the daemon
+    pthread_mutex_lock(&compileLock);
+    loaded = compile_child(jsonName, cacheName, meshDir) && load_scene_cache(cacheName, &oldest->scene);
+    pthread_mutex_unlock(&compileLock);
+  }
+  if (!loaded) {
+    drop_slot(oldest);
+    return NULL;
+  }
+  bound_lights(&oldest->scene);
+  return oldest;
 }
 
-// parse the next vector in the json file (array of 3 doubles)
-void next_vector(FILE* json, double* v) {
-  expect_c(json, '[');
-  skip_ws(json);
-  v[0] = next_number(json);
-  skip_ws(json);
-  expect_c(json, ',');
-  skip_ws(json);
-  v[1] = next_number(json);
-  skip_ws(json);
-  expect_c(json, ',');
-  skip_ws(json);
-  v[2] = next_number(json);
-  skip_ws(json);
-  expect_c(json, ']');
+// Empty a slot load_slot() claimed, for a scene that did not load or is not
+// the one asked for, and hand it back
+void drop_slot(CachedScene* cached) {
+  free_scene(&cached->scene);
+  pthread_mutex_lock(&sceneLock);
+  cached->id[0] = 0;
+  cached->key[0] = 0;
+  cached->loading = 0;
+  cached->users = 0;
+  pthread_mutex_unlock(&sceneLock);
 }
 
-// parse a json file based on filename and place any objects into object array
-void read_scene(char* filename) {
+// Hand back a scene find_scene() returned
+void release_scene(CachedScene* cached) {
+  pthread_mutex_lock(&sceneLock);
+  cached->users--;
+  pthread_mutex_unlock(&sceneLock);
+}
 
-  int c;
-  FILE* json = fopen(filename, "r");
-  if (json == NULL) {
-    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+// answer a daemon request with an error message
+void reply_error(int fd, char* message) {
+  char reply[daemonLineSize];
+  int length = snprintf(reply, sizeof(reply), "error %s\n", message);
+  send_bytes(fd, reply, length);
+}
+
+// write all of data to fd, returns 0 if the other end went away
+int send_bytes(int fd, void* data, size_t length) {
+  char* bytes = data;
+  while (length > 0) {
+    ssize_t written = write(fd, bytes, length);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return 0;
+    bytes += written;
+    length -= written;
+  }
+  return 1;
+}
+
+// fill in the address of the Unix socket socketName, returns 0 if the name is too long
+int unix_address(char* socketName, struct sockaddr_un* address) {
+  memset(address, 0, sizeof(struct sockaddr_un));
+  address->sun_family = AF_UNIX;
+  if (strlen(socketName) >= sizeof(address->sun_path)) return 0;
+  strcpy(address->sun_path, socketName);
+  return 1;
+}
+
+// connect to the daemon listening on socketName
+int connect_socket(char* socketName) {
+  struct sockaddr_un address;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || !unix_address(socketName, &address) ||
+      connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+    fprintf(stderr, "Error: Could not connect to a daemon on \"%s\"\n", socketName);
     exit(1);
   }
-  int camFlag = 0; // boolean to see if we have a camera obj yet
+  return fd;
+}
 
-  skip_ws(json);
-  expect_c(json, '['); // Find the beginning of the list
-  skip_ws(json);
+// Send sceneName and a request for the imageWidth by imageHeight frame, or
+// regionText of it, to the daemon on socketName, and save the P6 image it
+// returns in outputName. The daemon renders with the options it was started with.
+int request_render(char* socketName, char* sceneName, char* outputName, char* regionText) {
+  JsonInput scene;
+  map_json(sceneName, &scene);
+  size_t length = scene.end - scene.data;
+  int fd = connect_socket(socketName);
+  FILE* in = fdopen(fd, "r");
+  char request[daemonLineSize];
+  char reply[daemonLineSize];
+  char* directory = realpath(sceneName, NULL); // the daemon finds relative mesh file names in it
+  if (directory == NULL || strchr(directory, '\n') != NULL) {
+    fprintf(stderr, "Error: Could not find the directory of \"%s\"\n", sceneName);
+    exit(1);
+  }
+  *strrchr(directory, '/') = 0;
+  int requestLength = snprintf(request, sizeof(request), "scene %zu %s\n", length, directory[0] ? directory : "/");
+  free(directory);
+  if (requestLength >= (int)sizeof(request) || !send_bytes(fd, request, requestLength) ||
+      !send_bytes(fd, scene.data, length) || fgets(reply, sizeof(reply), in) == NULL) {
+    fprintf(stderr, "Error: The daemon on \"%s\" hung up.\n", socketName);
+    exit(1);
+  }
+  if (length > 0) munmap(scene.data, length);
+  char id[17];
+  if (sscanf(reply, "ok %16s", id) != 1) {
+    fprintf(stderr, "Error: The daemon answered %s", reply);
+    exit(1);
+  }
 
-  // Find the objects
-  while (1) {
+  requestLength = snprintf(request, sizeof(request), "render %s %zu %zu", id, imageWidth, imageHeight);
+  if (cameraSet) {
+    requestLength += snprintf(request + requestLength, sizeof(request) - requestLength, " camera %.17g,%.17g,%.17g",
+      (double)cameraOverride[0], (double)cameraOverride[1], (double)cameraOverride[2]);
+  }
+  if (regionText != NULL) {
+    requestLength += snprintf(request + requestLength, sizeof(request) - requestLength, " region %s", regionText);
+  }
+  requestLength += snprintf(request + requestLength, sizeof(request) - requestLength, "\n");
+  size_t imageBytes;
+  if (requestLength >= (int)sizeof(request) || !send_bytes(fd, request, requestLength) ||
+      fgets(reply, sizeof(reply), in) == NULL) {
+    fprintf(stderr, "Error: The daemon on \"%s\" hung up.\n", socketName);
+    exit(1);
+  }
+  if (sscanf(reply, "image %zu", &imageBytes) != 1) {
+    fprintf(stderr, "Error: The daemon answered %s", reply);
+    exit(1);
+  }
 
-    c = fgetc(json);
-    if (c == ']') {
-      fprintf(stderr, "Error: Empty object at line %d.\n", line);
-      fclose(json);
-      return;
+  FILE* out = fopen(outputName, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", outputName);
+    exit(1);
+  }
+  char buffer[1 << 16];
+  while (imageBytes > 0) {
+    size_t got = fread(buffer, 1, (imageBytes < sizeof(buffer)) ? imageBytes : sizeof(buffer), in);
+    if (got == 0) {
+      fprintf(stderr, "Error: The daemon on \"%s\" hung up mid image.\n", socketName);
+      exit(1);
     }
-    if (c == '{') {
-      skip_ws(json);
-      // Parse the object
-      char* key = next_string(json);
-      if (strcmp(key, "type") != 0) {
-        fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
-        exit(1);
+    fwrite(buffer, 1, got, out);
+    imageBytes -= got;
+  }
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Error: Could not write file \"%s\"\n", outputName);
+    exit(1);
+  }
+  fclose(in);
+  return 0;
+}
+
+// Render the scene again whenever its file or the OBJ file of one of its
+// meshes changes, until the process is killed. Each version is compiled by a
+// child process into outputName.rsc, so a half saved or broken file only
+// costs a message, then compared with the version on screen to trace just
+// the pixels the edit can change.
+void watch_scene(char* sceneName, char* outputName) {
+  char* cacheName = malloc(strlen(outputName) + 5);
+  char* tempName = malloc(strlen(outputName) + 5);
+  sprintf(cacheName, "%s.rsc", outputName);
+  sprintf(tempName, "%s.tmp", outputName);
+
+  struct stat info;
+  struct timespec seen = {0, 0}; // modification time and size of the version on screen,
+  off_t seenSize = -1; // unknown at first, the file may have changed during the first render
+  uint64_t seenStamp = 0; // mesh_sources_stamp() of the OBJ files as the version on screen read them
+  printf("Watching \"%s\" for changes\n", sceneName);
+  fflush(stdout);
+
+  for (;;) {
+    struct timespec pause = {0, watchPollMillis * 1000000L};
+    nanosleep(&pause, NULL);
+    uint64_t stamp = mesh_sources_stamp(&compiledScene, 0);
+    if (stat(sceneName, &info) != 0 || (info.st_size == seenSize && stamp == seenStamp &&
+        info.st_mtim.tv_sec == seen.tv_sec && info.st_mtim.tv_nsec == seen.tv_nsec)) {
+      continue;
+    }
+    seen = info.st_mtim;
+    seenSize = info.st_size;
+    seenStamp = stamp; // a version that does not compile is not tried again until a file changes
+
+    Scene edited;
+    memset(&edited, 0, sizeof(Scene));
+    if (!compile_child(sceneName, cacheName, meshDirectory) || !load_scene_cache(cacheName, &edited)) {
+      fprintf(stderr, "Note: \"%s\" did not compile, keeping the last image.\n", sceneName);
+      continue;
+    }
+    seenStamp = mesh_sources_stamp(&edited, 1); // so a change during the compile is seen next time
+    bound_lights(&edited);
+    if (cameraSet) {
+      memcpy(edited.cameraPosition, cameraOverride, sizeof(cameraOverride));
+    }
+
+    double start = seconds_now();
+    int relit;
+    size_t traced = update_image(&edited, &relit);
+    replace_image(tempName, outputName);
+    printf("%s %zu of %zu pixels (%.1f%%) in %.3f s\n", relit ? "Relit" : "Updated", traced, numPixels,
+      100.0 * traced / numPixels, seconds_now() - start);
+    fflush(stdout);
+  }
+}
+
+// hash the size and modification time of each OBJ file scene's meshes were
+// read from, as recorded when they were read, or as they are now, so --watch
+// can tell when one changes without reading it
+uint64_t mesh_sources_stamp(Scene* scene, int recorded) {
+  uint64_t stamp = hash_bytes(0, NULL, 0);
+  for (int i = 0; i < scene->numMeshSources; i++) {
+    MeshSource* source = &scene->meshSources[i];
+    int64_t version[2] = {(int64_t)source->size, source->modified};
+    struct stat info;
+    if (!recorded) {
+      char path[sizeof(source->path)];
+      memcpy(path, source->path, sizeof(path));
+      path[sizeof(path) - 1] = 0;
+      version[0] = version[1] = -1; // a file that is gone
+      if (stat(path, &info) == 0) {
+        version[0] = info.st_size;
+        version[1] = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
       }
-      skip_ws(json);
-      expect_c(json, ':');
-      skip_ws(json);
-      char* value = next_string(json);
+    }
+    stamp = hash_bytes(stamp, version, sizeof(version));
+  }
+  return stamp;
+}
+
+// Bring pixmap up to date with edited, which replaces compiledScene, tracing
+// only the pixels the edit can change, or when only the lights changed,
+// shading every lit pixel again from the points in visibility
+// Returns the number of pixels traced or shaded, and sets relit when shaded
+size_t update_image(Scene* edited, int* relit) {
+  numSphereEdits = scene_edits(&compiledScene, edited, relit);
+  editedScene = *edited;
+  if (numSphereEdits > 0) {
+    render_tiles(0, M, mark_dirty); // against the scene the pixels came from
+  }
+  free_scene(&compiledScene);
+  compiledScene = editedScene;
+  memset(&editedScene, 0, sizeof(Scene));
+
+  if (numSphereEdits < 0) {
+    *relit = 0;
+    raycast();
+    return numPixels;
+  }
+  if (*relit) { // the same points seen, under different lights
+    size_t shaded = 0;
+    for (size_t i = 0; i < numPixels; i++) {
+      shaded += hitBuffer[i] >= 0;
+    }
+    render_tiles(0, M, relight_tile);
+    return shaded;
+  }
+  size_t traced = 0;
+  for (size_t i = 0; i < numPixels && numSphereEdits > 0; i++) {
+    traced += dirtyMask[i];
+  }
+  if (traced > 0) {
+    render_tiles(0, M, retrace_tile);
+  }
+  return traced;
+}
+
+// Compare two versions of a scene and fill sphereEdits with the spheres that
+// differ. The result depends only on what is stored per object, so a moved,
+// resized or recolored sphere changes just the pixels that see it or whose
+// shadow rays pass through it. Sets relight when the lights or their reach
+// changed but the camera and every surface stayed, so each pixel still sees
+// the same point.
+// Returns the number of changed spheres, 0 when relighting, or -1 when the
+// edit can change any pixel: the camera, a plane, a mesh or its OBJ file or
+// the number of surfaces changed, spheres and lights both changed, or more
+// than watchMaxEdits spheres changed
+int scene_edits(Scene* old, Scene* edited, int* relight) {
+  *relight = old->numLights != edited->numLights ||
+    memcmp(old->lights, edited->lights, old->numLights * sizeof(Light)) != 0 ||
+    memcmp(old->lightRadii, edited->lightRadii, old->numLights * sizeof(real)) != 0;
+  if (old->numSurfaces != edited->numSurfaces || old->numPlanes != edited->numPlanes ||
+      old->numVertices != edited->numVertices || old->numTriangles != edited->numTriangles ||
+      memcmp(old->vertices, edited->vertices, old->numVertices * 3 * sizeof(float)) != 0 ||
+      memcmp(old->triangles, edited->triangles, old->numTriangles * sizeof(MeshTriangle)) != 0 ||
+      old->numMeshSources != edited->numMeshSources ||
+      memcmp(old->meshSources, edited->meshSources, old->numMeshSources * sizeof(MeshSource)) != 0 ||
+      memcmp(old->cameraPosition, edited->cameraPosition, sizeof(old->cameraPosition)) != 0 ||
+      old->cameraWidth != edited->cameraWidth || old->cameraHeight != edited->cameraHeight) {
+    return -1;
+  }
+  int count = 0;
+  for (int i = 0; i < old->numSurfaces; i++) {
+    Surface* before = &old->surfaces[i];
+    Surface* after = &edited->surfaces[i];
+    if (memcmp(before, after, sizeof(Surface)) == 0) continue;
+    if (before->kind != 1 || after->kind != 1 || count == watchMaxEdits || *relight) {
+      return -1;
+    }
+    sphereEdits[count].index = i;
+    sphereEdits[count].oldSlot = sphere_slot(old, i);
+    sphereEdits[count].newSlot = sphere_slot(edited, i);
+    count++;
+  }
+  return count;
+}
+
+// position of sphere index in the kernel arrays of scene
+int sphere_slot(Scene* scene, int index) {
+  for (int i = 0; i < scene->numSpheres; i++) {
+    if (scene->bvhIndices[i] == index) return i;
+  }
+  return -1;
+}
+
+// Set dirtyMask on the pixels of a tile whose color the sphere edits can
+// change: those whose center ray meets a changed sphere before or after the
+// edit, and those where a shadow ray from the recorded hit to a light does.
+// Every other pixel hits the same object at the same distance and sees the
+// same lights, so it keeps its color exactly.
+void mark_dirty(Tile tile, RenderContext* context) {
+  Scene* scene = context->scene; // the scene as rendered
+  for (size_t y = tile.y0; y < tile.y1; y++) {
+    for (size_t x = tile.x0; x < tile.x1; x++) {
+      size_t pixIndex = y * N + x;
+      real Ro[3];
+      real Rd[3];
+      primary_ray(scene, x + 0.5, y + 0.5, Ro, Rd);
+      int dirty = edits_block(scene, Ro, Rd, INFINITY);
+
+      if (!dirty && hitBuffer[pixIndex] >= 0) { // the shadow rays, made the way illuminate() makes them
+        real* objOrigin = visibility[pixIndex].position;
+        for (int i = 0; i < scene->numLights && !dirty; i++) {
+          Light* light = &scene->lights[i];
+          real lightDistance = p3_distance(light->position, objOrigin);
+          if (lightDistance >= scene->lightRadii[i]) continue; // never shaded, blocked or not
+
+          real objToLight[3];
+          v3_subtract(light->position, objOrigin, objToLight);
+          normalize(objToLight);
+          real newObjOrigin[3];
+          v3_scale(objToLight, shadowBias, newObjOrigin);
+          v3_add(newObjOrigin, objOrigin, newObjOrigin);
+          dirty = edits_block(scene, newObjOrigin, objToLight, lightDistance);
+        }
+      }
+      dirtyMask[pixIndex] = dirty;
+    }
+  }
+}
+
+// returns 1 if the ray Ro->Rd meets a changed sphere, before or after the
+// edit, no further than maxT
+int edits_block(Scene* scene, real* Ro, real* Rd, real maxT) {
+  for (int i = 0; i < numSphereEdits; i++) {
+    SphereEdit* edit = &sphereEdits[i];
+    real before = edit_intersection(scene, edit->index, edit->oldSlot, Ro, Rd);
+    real after = edit_intersection(&editedScene, edit->index, edit->newSlot, Ro, Rd);
+    if ((before > 0 && before <= maxT && before < INFINITY) ||
+        (after > 0 && after <= maxT && after < INFINITY)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// distance along Ro->Rd to sphere index of scene, at kernel array position
+// slot, computed the same way the traversals compute it so both agree exactly
+real edit_intersection(Scene* scene, int index, int slot, real* Ro, real* Rd) {
+  if (!useBVH) {
+    return surface_intersection(&scene->surfaces[index], Ro, Rd);
+  }
+  real t[kernelLanes];
+  sphereKernel(Ro, Rd, &scene->spheres, slot, 1, t);
+  return t[0];
+}
+
+// shade the lit pixels of a tile again from the points in visibility, with
+// no primary rays
+void relight_tile(Tile tile, RenderContext* context) {
+  cull_lights(tile.x0, tile.y0, tile.x1, tile.y1, context);
+  for (size_t y = tile.y0; y < tile.y1; y++) {
+    for (size_t x = tile.x0; x < tile.x1; x++) {
+      size_t pixIndex = y * N + x;
+      if (hitBuffer[pixIndex] < 0) continue; // the background stays black
+      real color[3];
+      illuminate(hitBuffer[pixIndex], visibility[pixIndex].position, visibility[pixIndex].normal, color, context);
+      store_pixel(pixIndex, color, hitBuffer[pixIndex], &visibility[pixIndex], context);
+    }
+  }
+}
+
+// trace again the pixels of a tile marked in dirtyMask
+void retrace_tile(Tile tile, RenderContext* context) {
+  cull_lights(tile.x0, tile.y0, tile.x1, tile.y1, context);
+  for (size_t y = tile.y0; y < tile.y1; y++) {
+    for (size_t x = tile.x0; x < tile.x1; x++) {
+      size_t pixIndex = y * N + x;
+      if (!dirtyMask[pixIndex]) continue;
+      real color[3];
+      VisiblePoint hit;
+      int closestIndex = trace_sample(x + 0.5, y + 0.5, context, color, &hit);
+      store_pixel(pixIndex, color, closestIndex, &hit, context);
+    }
+  }
+}
+
+int main(int args, char** argv) {
+  char* positional[4]; // width, height, input.json, output.ppm
+  int numPositional = 0;
+  char* regionText = NULL;
+
+  #ifdef ALLOC_STATS
+  atexit(report_allocations);
+  #endif
 
-      int kind;
-      if (strcmp(value, "plane") == 0) {
-        physicalObjects[numPhysicalObjects].kind = 0;
-        kind = 0;
+  for (int i = 1; i < args; i++) { // separate options from positional arguments
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < args) {
+      numThreads = atoi(argv[++i]);
+      if (numThreads == 0) { // use every available core
+        numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
       }
-      else if (strcmp(value, "sphere") == 0) {
-        physicalObjects[numPhysicalObjects].kind = 1;
-        kind = 1;
+      if (numThreads < 1) {
+        fprintf(stderr, "Error: Number of threads must be positive.\n");
+        exit(1);
       }
-      else if (strcmp(value, "light") == 0) {
-        lightObjects[numLightObjects].kind = 2;
-        kind = 2;
+    }
+    else if (strcmp(argv[i], "--format") == 0 && i + 1 < args) {
+      i++;
+      if (strcmp(argv[i], "p3") == 0 || strcmp(argv[i], "P3") == 0) {
+        outputFormat = '3';
       }
-      else if (strcmp(value, "camera") == 0) {
-        if (camFlag == 1) {
-          fprintf(stderr, "Error: Too many camera objects, see line: %d.\n", line);
-          exit(1);
-        }
-        cameraObject.kind = 3;
-        cameraObject.position[0] = 0;
-        cameraObject.position[1] = 0;
-        cameraObject.position[2] = 0;
-        camFlag = 1;
-        kind = 3;
+      else if (strcmp(argv[i], "p6") == 0 || strcmp(argv[i], "P6") == 0) {
+        outputFormat = '6';
       }
       else {
-        fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
+        fprintf(stderr, "Error: Unknown output format \"%s\", expected p3 or p6.\n", argv[i]);
         exit(1);
       }
-      skip_ws(json);
-
-      while (1) { // parse the current object
-
-        c = next_c(json);
-        if (c == '}') {
-          break; // stop parsing this object
-        }
-        else if (c == ',') {
-          // read another field
-          skip_ws(json);
-          char* key = next_string(json);
-          skip_ws(json);
-          expect_c(json, ':');
-          skip_ws(json);
-          if (strcmp(key, "width") == 0) {
-            double value = next_number(json);
-            if (kind == 3) {
-              cameraObject.camera.width = value;
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'width' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "height") == 0) {
-            double value = next_number(json);
-            if (kind == 3) {
-              cameraObject.camera.height = value;
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'height' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "radius") == 0) {
-            double value = next_number(json);
-            if (kind == 1) {
-              physicalObjects[numPhysicalObjects].sphere.radius = value;
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'radius' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "color") == 0) {
-            double value[3];
-            next_vector(json, value);
-            if (kind == 0 || kind == 1) {
-              memcpy(physicalObjects[numPhysicalObjects].color, value, sizeof(double) * 3);
-            }
-            else if (kind == 2) {
-              memcpy(lightObjects[numLightObjects].color, value, sizeof(double) * 3);
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'color' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "diffuse_color") == 0) {
-            double value[3];
-            next_vector(json, value);
-            if (kind == 0 || kind == 1) {
-              memcpy(physicalObjects[numPhysicalObjects].diffuseColor, value, sizeof(double) * 3);
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'diffuse_color' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "specular_color") == 0) {
-            double value[3];
-            next_vector(json, value);
-            if (kind == 0 || kind == 1) {
-              memcpy(physicalObjects[numPhysicalObjects].specularColor, value, sizeof(double) * 3);
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'specular_color' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "position") == 0) {
-            double value[3];
-            next_vector(json, value);
-            if (kind == 0 || kind == 1) {
-              memcpy(physicalObjects[numPhysicalObjects].position, value, sizeof(double) * 3);
-            }
-            else if (kind == 2) {
-              memcpy(lightObjects[numLightObjects].position, value, sizeof(double) * 3);
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'position' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "normal") == 0) {
-            double value[3];
-            next_vector(json, value);
-            if (kind == 0) {
-              memcpy(physicalObjects[numPhysicalObjects].plane.normal, value, sizeof(double) * 3);
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'normal' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "direction") == 0) {
-            double value[3];
-            next_vector(json, value);
-            if (kind == 2) {
-              memcpy(lightObjects[numLightObjects].light.direction, value, sizeof(double) * 3);
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'direction' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "radial-a0") == 0) {
-            double value = next_number(json);
-            if (kind == 2) {
-              lightObjects[numLightObjects].light.radialA0 = value;
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'radial-a0' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "radial-a1") == 0) {
-            double value = next_number(json);
-            if (kind == 2) {
-              lightObjects[numLightObjects].light.radialA1 = value;
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'radial-a1' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "radial-a2") == 0) {
-            double value = next_number(json);
-            if (kind == 2) {
-              lightObjects[numLightObjects].light.radialA2 = value;
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'radial-a2' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "angular-a0") == 0) {
-            double value = next_number(json);
-            if (kind == 2) {
-              lightObjects[numLightObjects].light.angularA0 = value;
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'angular-a0' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else if (strcmp(key, "theta") == 0) {
-            double value = next_number(json);
-            if (kind == 2) {
-              lightObjects[numLightObjects].light.theta = value;
-            }
-            else {
-              fprintf(stderr, "Error: Unexpected 'theta' attribute on line %d.\n", line);
-              exit(1);
-            }
-          }
-          else {
-            fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n", key, line);
-            exit(1);
-          }
-          skip_ws(json);
-        }
-        else {
-          fprintf(stderr, "Error: Unexpected value on line %d\n", line);
-          exit(1);
-        }
-      } // end loop through object fields
-
-      if (camFlag == 0) { // ensure that we parsed a camera
-        fprintf(stderr, "Error: The JSON file does not contain a camera object.\n");
+    }
+    else if (strcmp(argv[i], "--stream") == 0 && i + 1 < args) {
+      char* end;
+      streamRows = strtoull(argv[++i], &end, 10); // 0 picks the band size
+      if (*end != 0 || argv[i][0] == '-') {
+        fprintf(stderr, "Error: --stream expects a number of rows per band.\n");
         exit(1);
       }
-
-      // increment appropriate counter
-      if (kind == 0 || kind == 1) {
-        numPhysicalObjects++;
+      streamOutput = 1;
+    }
+    else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < args) {
+      kernelName = argv[++i]; // scalar, sse2 or avx2
+    }
+    else if (strcmp(argv[i], "--bench-kernels") == 0 && i + 1 < args) {
+      bench_kernels(atoi(argv[++i]));
+      return 0;
+    }
+    else if (strcmp(argv[i], "--bench-load") == 0 && i + 1 < args) {
+      int runs = (i + 2 < args) ? atoi(argv[i + 2]) : 5;
+      bench_load(argv[i + 1], runs > 0 ? runs : 5);
+      return 0;
+    }
+    else if (strcmp(argv[i], "--mesh-dir") == 0 && i + 1 < args) {
+      meshDirectory = argv[++i];
+    }
+    else if (strcmp(argv[i], "--compile") == 0 && i + 2 < args) {
+      read_scene(argv[i + 1]);
+      compile_scene(&compiledScene);
+      write_scene_cache(argv[i + 1], argv[i + 2], &compiledScene);
+      clean_up();
+      return 0;
+    }
+    else if (strcmp(argv[i], "--aa") == 0 && i + 1 < args) {
+      char* end;
+      aaThreshold = strtod(argv[++i], &end); // largest color difference left alone, 0 to 1
+      if (*end != 0 || !(aaThreshold >= 0 && aaThreshold <= 1)) {
+        fprintf(stderr, "Error: --aa expects a color threshold between 0 and 1.\n");
+        exit(1);
       }
-      else if (kind == 2) {
-        numLightObjects++;
+    }
+    else if (strcmp(argv[i], "--progressive") == 0 && i + 1 < args) {
+      char* end;
+      progressiveStep = strtoull(argv[++i], &end, 10);
+      if (*end != 0 || argv[i][0] == '-' || progressiveStep == 0 || (progressiveStep & (progressiveStep - 1)) != 0) {
+        fprintf(stderr, "Error: --progressive expects a power of two lattice spacing.\n");
+        exit(1);
       }
-
-      skip_ws(json);
-      c = next_c(json);
-      if (c == ',') {
-        skip_ws(json);
+    }
+    else if (strcmp(argv[i], "--packet") == 0 && i + 1 < args) {
+      char* end;
+      packetSize = strtol(argv[++i], &end, 10); // 0 traces single rays
+      if (*end != 0 || !(packetSize == 0 || packetSize == 2 || packetSize == 4 || packetSize == maxPacketSize)) {
+        fprintf(stderr, "Error: --packet expects a packet size of 0, 2, 4 or 8.\n");
+        exit(1);
       }
-      else if (c == ']') {
-        fclose(json);
-        return;
+    }
+    else if (strcmp(argv[i], "--light-cutoff") == 0 && i + 1 < args) {
+      char* end;
+      lightCutoff = strtod(argv[++i], &end); // color levels out of 255, 0 shades every light
+      if (*end != 0 || !(lightCutoff >= 0 && lightCutoff <= maxColor)) {
+        fprintf(stderr, "Error: --light-cutoff expects a number of color levels between 0 and 255.\n");
+        exit(1);
       }
-      else {
-        fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
+    }
+    else if (strcmp(argv[i], "--camera") == 0 && i + 1 < args) {
+      if (!parse_camera(argv[++i], cameraOverride)) {
+        fprintf(stderr, "Error: --camera expects a position x,y,z.\n");
         exit(1);
       }
+      cameraSet = 1;
     }
-  } // end loop through all objects in scene
-}
-
-// function to print out all the objects to stdout, for debugging
-void printObjs() {
-  for (int i = 0; i < numPhysicalObjects; i++) {
-    printf("Object %i: type = %i; position = [%lf, %lf, %lf]; color = [%lf, %lf, %lf]\n", i, physicalObjects[i].kind,
-    physicalObjects[i].position[0],
-    physicalObjects[i].position[1],
-    physicalObjects[i].position[2],
-    physicalObjects[i].color[0],
-    physicalObjects[i].color[1],
-    physicalObjects[i].color[2]);
-    if (physicalObjects[i].kind == 1) {
-      printf("  Radius = %lf\n", physicalObjects[i].sphere.radius);
+    else if (strcmp(argv[i], "--daemon") == 0 && i + 1 < args) {
+      daemonName = argv[++i]; // socket to serve renders on
     }
-    else if (physicalObjects[i].kind == 0) {
-      printf("  Normal = [%lf, %lf, %lf]\n", physicalObjects[i].plane.normal[0], physicalObjects[i].plane.normal[1], physicalObjects[i].plane.normal[2]);
+    else if (strcmp(argv[i], "--connect") == 0 && i + 1 < args) {
+      connectName = argv[++i]; // socket of a running daemon to render with
     }
-  }
-  for (int i = 0; i < numLightObjects; i++) {
-    printf("Light Object %i: type = %i; position = [%lf, %lf, %lf]\n", i, lightObjects[i].kind,
-    lightObjects[i].position[0],
-    lightObjects[i].position[1],
-    lightObjects[i].position[2]);
-    printf("   A0: %lf; A1: %lf A2: %lf\n",
-    lightObjects[i].light.radialA0,
-    lightObjects[i].light.radialA1,
-    lightObjects[i].light.radialA2);
-  }
-  printf("Camera: type = %i\n", cameraObject.kind);
-}
-
-// function to print out the contents of pixmap to stdout, for debugging
-void printPixMap() {
-  int i = 0;
-  for (int y = 0; y < M; y++) {
-    for (int x = 0; x < N; x++) {
-      printf("[%i, %i, %i] ", pixmap[i].R, pixmap[i].G, pixmap[i].B); // print the pixel
-      i++;
+    else if (strcmp(argv[i], "--region") == 0 && i + 1 < args) {
+      regionText = argv[++i]; // x0,y0,x1,y1, checked once the frame size is known
+    }
+    else if (strcmp(argv[i], "--merge") == 0 && i + 2 < args) {
+      if (outputFormat == 0) outputFormat = format_from_filename(argv[i + 1]);
+      return merge_regions(argv[i + 1], args - i - 2, &argv[i + 2]);
+    }
+    else if (strcmp(argv[i], "--animate") == 0 && i + 1 < args) {
+      animationName = argv[++i]; // keyframes, output name gets a frame number
+    }
+    else if (strcmp(argv[i], "--stats") == 0 && i + 1 < args) {
+      statsName = argv[++i]; // counters and phase timings as json, - for stdout
+    }
+    else if (strcmp(argv[i], "--compare") == 0 && i + 2 < args) {
+      return compare_images(argv[i + 1], argv[i + 2]);
+    }
+    else if (strcmp(argv[i], "--watch") == 0) {
+      watchScene = 1; // keep rendering the scene file as it changes
+    }
+    else if (strcmp(argv[i], "--no-bvh") == 0) {
+      useBVH = 0; // linear scan, to measure the BVH against
+    }
+    else if (numPositional < 4) {
+      positional[numPositional++] = argv[i];
+    }
+    else {
+      numPositional++;
     }
-    printf("\n");
   }
-}
 
-int main(int args, char** argv) {
-  if (args != 5) {
-    fprintf(stderr, "Usage: raycast width height input.json output.ppm\n");
+  if (daemonName != NULL) {
+    return run_daemon(daemonName);
+  }
+  if (numPositional != 4) {
+    fprintf(stderr, "Usage: raycast [--format p3|p6] [--stream ROWS] [--animate keys.json] [--progressive STEP] [--aa THRESHOLD] [--packet N] [--light-cutoff LEVELS] [--region x0,y0,x1,y1] [--camera x,y,z] [--watch] [--connect SOCKET] [--stats FILE] [--threads N] [--no-bvh] [--kernel scalar|sse2|avx2] [--mesh-dir DIR] width height input.json output.ppm\n       raycast [--mesh-dir DIR] --compile input.json output.rsc\n       raycast --merge output.ppm part.ppm...\n       raycast [render options] --daemon SOCKET\n");
+    exit(1);
+  }
+  M = parse_dimension(positional[1], "height"); // save height
+  N = parse_dimension(positional[0], "width"); // save width
+  if (M > SIZE_MAX / N / sizeof(RGBpixel)) {
+    fprintf(stderr, "Error: A %zu by %zu image is too large.\n", N, M);
     exit(1);
   }
-
-  M = atoi(argv[2]); // save height
-  N = atoi(argv[1]); // save width
   numPixels = M * N; // total pixels for output image
-
-  // initialize pixmap based on the number of pixels
-  pixmap = malloc(sizeof(RGBpixel) * numPixels);
+  imageWidth = N;
+  imageHeight = M;
+  if (regionText != NULL) {
+    if (animationName != NULL || progressiveStep != 0) {
+      fprintf(stderr, "Error: --region can not be combined with --animate or --progressive.\n");
+      exit(1);
+    }
+    if (!parse_region(regionText, N, M)) {
+      fprintf(stderr, "Error: --region expects x0,y0,x1,y1 with x0 < x1 <= %zu and y0 < y1 <= %zu.\n", N, M);
+      exit(1);
+    }
+    setup_region(); // N and M become the size of the region
+  }
+  if (connectName != NULL) { // the daemon renders, with its own options
+    return request_render(connectName, positional[2], positional[3], regionText);
+  }
 
   // initialize counters
   numPhysicalObjects = 0;
   numLightObjects = 0;
 
-  //physicalObjects = malloc(maxObjects * sizeof(Object));
-  //lightObjects = malloc(maxObjects * sizeof(Object));
+  physicalObjects = NULL; // grown as objects are read
+  lightObjects = NULL;
+  physicalCapacity = 0;
+  lightCapacity = 0;
+  meshVertices = NULL;
+  meshTriangles = NULL;
+  meshSources = NULL;
+  numMeshVertices = 0;
+  numMeshTriangles = 0;
+  numMeshSources = 0;
+
+  double loadStart = seconds_now();
+  load_scene(positional[2], &compiledScene);
+  if (cameraSet) {
+    memcpy(compiledScene.cameraPosition, cameraOverride, sizeof(cameraOverride));
+  }
+  loadSeconds = seconds_now() - loadStart;
+  if (aaThreshold >= 0) { // remember what each pixel hit to find the edges
+    if (streamOutput) {
+      fprintf(stderr, "Error: --aa can not be combined with --stream.\n");
+      exit(1);
+    }
+    hitBuffer = malloc(numPixels * sizeof(int));
+    if (hitBuffer == NULL) {
+      fprintf(stderr, "Error: Not enough memory for a %zu by %zu image.\n", N, M);
+      exit(1);
+    }
+  }
+  if (watchScene) { // remember what each pixel hit and where, to find the pixels an edit changes
+    if (animationName != NULL || progressiveStep != 0 || streamOutput || aaThreshold >= 0) {
+      fprintf(stderr, "Error: --watch can not be combined with --animate, --progressive, --stream or --aa.\n");
+      exit(1);
+    }
+    hitBuffer = malloc(numPixels * sizeof(int));
+    visibility = malloc(numPixels * sizeof(VisiblePoint));
+    dirtyMask = malloc(numPixels);
+    if (hitBuffer == NULL || visibility == NULL || dirtyMask == NULL) {
+      fprintf(stderr, "Error: Not enough memory for a %zu by %zu image.\n", N, M);
+      exit(1);
+    }
+  }
+
+  if (animationName != NULL) { // render every frame in this process
+    if (streamOutput) {
+      fprintf(stderr, "Error: --animate can not be combined with --stream.\n");
+      exit(1);
+    }
+    read_animation(animationName, &compiledScene);
+    render_animation(positional[3]);
+  }
+  else {
+    if (outputFormat == 0) {
+      outputFormat = format_from_filename(positional[3]);
+    }
+
+    if (progressiveStep != 0) { // coarse to fine previews
+      if (streamOutput) {
+        fprintf(stderr, "Error: --progressive can not be combined with --stream.\n");
+        exit(1);
+      }
+      render_progressive(positional[3], progressiveStep);
+    }
+    else if (streamOutput) { // render band by band into the output file
+      if (outputFormat != '6') {
+        fprintf(stderr, "Error: Streaming output needs the P6 format, use --format p6.\n");
+        exit(1);
+      }
+      render_streaming(positional[3]);
+    }
+    else {
+      // initialize pixmap based on the number of pixels
+      pixmap = malloc(sizeof(RGBpixel) * numPixels);
+      if (pixmap == NULL) {
+        fprintf(stderr, "Error: Not enough memory for a %zu by %zu image, try --stream.\n", N, M);
+        exit(1);
+      }
 
-  read_scene(argv[3]);
-  raycast();
+      double raycastStart = seconds_now();
+      raycast();
+      if (aaThreshold >= 0) {
+        antialias();
+        report_antialiasing();
+      }
+      if (useRegion) crop_region();
+      raycastSeconds = seconds_now() - raycastStart;
 
-  // finished creating image data, write out
-  FILE* fh = fopen(argv[4], "w");
-  writeP3(fh);
+      // finished creating image data, write out
+      double writeStart = seconds_now();
+      FILE* fh = fopen(positional[3], "wb");
+      if (fh == NULL) {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", positional[3]);
+        exit(1);
+      }
+      if (outputFormat == '6') {
+        writeP6(fh);
+      }
+      else {
+        writeP3(fh);
+      }
+      writeSeconds = seconds_now() - writeStart;
+    }
+  }
 
+  if (statsName != NULL) {
+    write_stats(statsName, positional[2]);
+  }
+  if (watchScene) {
+    watch_scene(positional[2], positional[3]); // until the process is killed
+  }
   clean_up();
   return 0; // exit success
 }
 
 // free all allocated memory
 void clean_up() {
+  stop_pool();
   free(pixmap);
-  //free(physicalObjects);
-  //free(lightObjects);
+  free(hitBuffer);
+  free(visibility);
+  free(aaMask);
+  free(dirtyMask);
+  if (tileQueues != NULL) {
+    for (int i = 0; i < numThreads; i++) {
+      pthread_mutex_destroy(&tileQueues[i].lock);
+    }
+  }
+  free(tileQueues);
+  free(tiles);
+  for (int i = 0; i < numTracks; i++) {
+    free(tracks[i].keys);
+  }
+  free(tracks);
+  free(physicalObjects);
+  free(lightObjects);
+  free(meshVertices);
+  free(meshTriangles);
+  free(meshSources);
+  free_scene(&compiledScene);
 }
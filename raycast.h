@@ -1,14 +1,129 @@
 #include <ctype.h>
-#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <tgmath.h> // sqrt, pow and friends follow the type of real
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_KERNELS // SSE2 and AVX2 intersection kernels are available
+#include <immintrin.h>
+#endif
+
+// Scalar type of all geometry and shading, chosen at compile time
+// Build with -DSINGLE_PRECISION for float, which doubles the SIMD width and
+// halves the size of the scene arrays, at the cost of precision
+#ifdef SINGLE_PRECISION
+typedef float real;
+#define realName "float"
+#define epsilon 1e-5f // tolerated error for comparing reals
+#define shadowBias 1e-3f // shadow rays start this far off the surface, past its rounding error
+#define boxPadding 1e-6f // BVH boxes grow by this fraction of their coordinates
+#define kernelLanes 8 // widest SIMD kernel, arrays are padded by kernelLanes - 1
+#else
+typedef double real;
+#define realName "double"
+#define epsilon 0.0000001 // tolerated error for comparing reals
+#define shadowBias 0.0000001 // shadow rays start this far off the surface
+#define boxPadding 1e-9 // BVH boxes grow by this fraction of their coordinates
+#define kernelLanes 4 // widest SIMD kernel, arrays are padded by kernelLanes - 1
+#endif
+
+// SSE2 and AVX2 operations on vectors of real, so each kernel is written once
+#ifdef X86_KERNELS
+#ifdef SINGLE_PRECISION
+#define sseVec __m128
+#define sseLanes 4
+#define sse_set1 _mm_set1_ps
+#define sse_setzero _mm_setzero_ps
+#define sse_loadu _mm_loadu_ps
+#define sse_storeu _mm_storeu_ps
+#define sse_add _mm_add_ps
+#define sse_sub _mm_sub_ps
+#define sse_mul _mm_mul_ps
+#define sse_div _mm_div_ps
+#define sse_sqrt _mm_sqrt_ps
+#define sse_cmpgt _mm_cmpgt_ps
+#define sse_and _mm_and_ps
+#define sse_andnot _mm_andnot_ps
+#define sse_or _mm_or_ps
+#define avxVec __m256
+#define avxLanes 8
+#define avx_set1 _mm256_set1_ps
+#define avx_setzero _mm256_setzero_ps
+#define avx_loadu _mm256_loadu_ps
+#define avx_storeu _mm256_storeu_ps
+#define avx_add _mm256_add_ps
+#define avx_sub _mm256_sub_ps
+#define avx_mul _mm256_mul_ps
+#define avx_div _mm256_div_ps
+#define avx_sqrt _mm256_sqrt_ps
+#define avx_cmp _mm256_cmp_ps
+#define avx_blendv _mm256_blendv_ps
+#else
+#define sseVec __m128d
+#define sseLanes 2
+#define sse_set1 _mm_set1_pd
+#define sse_setzero _mm_setzero_pd
+#define sse_loadu _mm_loadu_pd
+#define sse_storeu _mm_storeu_pd
+#define sse_add _mm_add_pd
+#define sse_sub _mm_sub_pd
+#define sse_mul _mm_mul_pd
+#define sse_div _mm_div_pd
+#define sse_sqrt _mm_sqrt_pd
+#define sse_cmpgt _mm_cmpgt_pd
+#define sse_and _mm_and_pd
+#define sse_andnot _mm_andnot_pd
+#define sse_or _mm_or_pd
+#define avxVec __m256d
+#define avxLanes 4
+#define avx_set1 _mm256_set1_pd
+#define avx_setzero _mm256_setzero_pd
+#define avx_loadu _mm256_loadu_pd
+#define avx_storeu _mm256_storeu_pd
+#define avx_add _mm256_add_pd
+#define avx_sub _mm256_sub_pd
+#define avx_mul _mm256_mul_pd
+#define avx_div _mm256_div_pd
+#define avx_sqrt _mm256_sqrt_pd
+#define avx_cmp _mm256_cmp_pd
+#define avx_blendv _mm256_blendv_pd
+#endif
+#endif
 
 // Hard coded Program Constants
 #define maxColor 255
-#define format '3' // format of output image data
-#define maxObjects 128
-#define epsilon 0.0000001 // tolerated error for comparing doubles
+#define format '3' // default format of output image data
+#define writeBufferSize (1 << 20) // bytes of P3 text formatted before each write
+#define ppmHeaderSize 256 // room for an image header, region comment included
+#define sceneCacheMagic "RAYSCENE" // first 8 bytes of a compiled scene file
+#define sceneCacheVersion 2 // bump whenever the compiled scene layout changes
+#define sceneCacheSections 17 // number of arrays stored in a compiled scene file
+#define sceneCacheAlign 64 // byte alignment of each array in a compiled scene file
+#define aaGrid 4 // antialiased pixels average aaGrid by aaGrid samples
+#define streamBandBytes (64 << 20) // size of a streamed band when --stream is given 0 rows
+#define initialObjects 16 // starting capacity of the growable object arrays
+#define daemonLineSize (PATH_MAX + 64) // longest request line the daemon accepts, a directory fits
+#define daemonScenes 16 // compiled scenes the daemon keeps loaded, the least recently used go first
+#define daemonMaxSceneBytes (1 << 30) // largest scene the daemon accepts
+#define daemonMaxPixels (1 << 28) // largest image the daemon renders
+#define watchPollMillis 100 // how often --watch looks at the scene file and its OBJ files
+#define watchMaxEdits 16 // spheres an edit may change before --watch renders every pixel again
 
 #define ambientIntensity 1 // ambient lighting
 #define diffuseIntensity 1 // diffuse lighting
@@ -17,116 +132,649 @@
 #define ambience 0.1 // ambient lighting color
 #define specularPower 20 // degree of specular reflection, hard coded to 20
 
+#define tileSize 32 // width and height in pixels of a render tile
+#define bvhLeafSize 4 // maximum number of spheres in a BVH leaf
+#define bvhMaxDepth 64 // size of the traversal stack, deeper than any built tree
+#define meshLeafSize 4 // most triangles in a mesh BVH leaf, unless they can not be split
+#define meshBins 16 // candidate split planes along an axis when building the mesh BVH
+#define meshBoxPadding 1e-6f // mesh BVH boxes, stored in float, grow by this fraction of their coordinates
+#define maxPacketSize 8 // largest width and height in pixels of a ray packet
+#define cullMargin 1e-4 // relative slack of the tile light culling, for the rounding of hit points
+
 // Structure to hold RGB pixel data
 typedef struct RGBpixel {
   unsigned char R, G, B;
 } RGBpixel;
 
+// P6 output writes the pixmap as is, which needs RGBpixel to be exactly 3 bytes
+typedef char RGBpixelIsPacked[(sizeof(RGBpixel) == 3) ? 1 : -1];
+
 // Structure to hold an object's data in the scene
 typedef struct {
-  int kind; // 0 = plane, 1 = sphere, 2 = light, 3 = camera
-  double color[3];
-  double position[3];
-  double diffuseColor[3];
-  double specularColor[3];
+  int kind; // 0 = plane, 1 = sphere, 2 = light, 3 = camera, 4 = mesh
+  real color[3];
+  real position[3];
+  real diffuseColor[3];
+  real specularColor[3];
   union {
     struct {
-      double normal[3];
+      real normal[3];
     } plane;
     struct {
-      double radius;
+      real radius;
     } sphere;
     struct {
-      double direction[3];
-      double radialA2;
-      double radialA1;
-      double radialA0;
-      double angularA0;
-      double theta;
+      real direction[3];
+      real radialA2;
+      real radialA1;
+      real radialA0;
+      real angularA0;
+      real theta;
     } light;
     struct {
-      double width;
-      double height;
+      real width;
+      real height;
     } camera;
+    struct {
+      real scale; // multiplies the coordinates of the OBJ file, before position is added
+      int firstTriangle; // the triangles read from the OBJ file, in meshTriangles
+      int numTriangles;
+    } mesh;
   };
 } Object;
 
+// Structure to hold a memory mapped json file being parsed
+typedef struct {
+  char* data; // start of the mapped file
+  char* pos; // next character to read
+  char* end; // one past the last character
+} JsonInput;
+
+// Structure to hold a string token, pointing into the mapped json file
+typedef struct {
+  char* start;
+  size_t length;
+} Token;
+
+// Structure to hold a rectangle of pixels to be rendered, [x0, x1) by [y0, y1)
+typedef struct {
+  size_t x0, y0, x1, y1;
+} Tile;
+
+// Structure to hold a node of the bounding volume hierarchy over the spheres
+// Interior nodes have their children at nodes first and first + 1, leaves
+// hold count entries of bvhIndices starting at first.
+typedef struct {
+  real min[3];
+  real max[3];
+  int first;
+  int count; // number of spheres in a leaf, 0 for interior nodes
+} BVHNode;
+
+// Structure to hold a triangle of a mesh, as indices into the vertex array
+// shared by every mesh, and the surface whose material it has
+typedef struct {
+  uint32_t v[3];
+  uint32_t surface;
+} MeshTriangle;
+
+// Structure to hold a node of the bounding volume hierarchy over the
+// triangles of every mesh, like BVHNode but with float bounds to halve its size
+typedef struct {
+  float min[3];
+  float max[3];
+  uint32_t first;
+  uint32_t count; // number of triangles in a leaf, 0 for interior nodes
+} MeshNode;
+
+// Structure to hold an OBJ file a mesh was read from, so a compiled scene can
+// tell when the file has changed since
+typedef struct {
+  char path[1024]; // absolute path of the OBJ file
+  uint64_t size; // size, modification time and hash of the file when it was read
+  int64_t modified;
+  uint64_t hash;
+} MeshSource;
+
+// Structure of arrays copy of the spheres' centers and radii, in BVH leaf
+// order, so that one ray can be tested against several spheres at once
+typedef struct {
+  real* x;
+  real* y;
+  real* z;
+  real* radius;
+} SphereArrays;
+
+// Structure of arrays copy of the planes' normals and distances from the origin
+typedef struct {
+  real* x;
+  real* y;
+  real* z;
+  real* d;
+} PlaneArrays;
+
+// Batched intersection kernels, test the ray Ro->Rd against count primitives
+// starting at first and store each distance (or -1) in t
+typedef void (*SphereKernel)(real* Ro, real* Rd, SphereArrays* spheres, int first, int count, real* t);
+typedef void (*PlaneKernel)(real* Ro, real* Rd, PlaneArrays* planes, int first, int count, real* t);
+
+// Structure to hold a plane, sphere or mesh ready for rendering, compiled from
+// an Object by compile_scene() and only changed afterwards by animate_frame()
+// A mesh only keeps its material here, its triangles are in Scene.triangles.
+typedef struct {
+  int kind; // 0 = plane, 1 = sphere, 4 = mesh
+  real position[3];
+  real normal[3]; // unit normal of a plane
+  real d; // plane: -(normal dot position), its signed distance from the origin
+  real radius; // sphere
+  real diffuseColor[3];
+  real specularColor[3];
+} Surface;
+
+// Light classes, a bit mask of the terms a light needs when shading
+#define lightAttenuated 1 // has radial attenuation coefficients
+#define lightSpot 2 // restricted to a cone around its direction
+
+// Structure to hold a light ready for rendering, compiled from an Object
+typedef struct {
+  int lightClass; // lightAttenuated and/or lightSpot, 0 for a plain point light
+  real position[3];
+  real color[3];
+  real direction[3]; // unit vector the spot light points along
+  real radialA0;
+  real radialA1;
+  real radialA2;
+  real angularA0;
+  real cosTheta; // points with cos(angle off the direction) below this are unlit
+} Light;
+
+// Structure to hold everything the render loop reads, built once between
+// read_scene() and raycast()
+// Hits are named by the index of the surface, or for the triangles of a mesh,
+// numSurfaces plus the index of the triangle.
+typedef struct {
+  Surface* surfaces; // same order as physicalObjects, indices identify objects
+  int numSurfaces;
+  Light* lights;
+  int numLights;
+  real cameraPosition[3];
+  real cameraWidth;
+  real cameraHeight;
+  BVHNode* bvhNodes; // nodes of the BVH over the spheres, the root is node 0
+  int numBVHNodes;
+  int* bvhIndices; // indices of the spheres, in leaf order
+  int* planeIndices; // indices of the planes, which are unbounded
+  int numPlanes;
+  int numSpheres;
+  SphereArrays spheres; // the spheres of bvhIndices, in the same order
+  PlaneArrays planes; // the planes of planeIndices, in the same order
+  float* vertices; // x, y and z of every vertex of every mesh
+  int numVertices;
+  MeshTriangle* triangles; // the triangles of every mesh, in leaf order
+  int numTriangles;
+  MeshNode* meshNodes; // nodes of the BVH over the triangles, the root is node 0
+  int numMeshNodes;
+  MeshSource* meshSources; // the OBJ files the meshes were read from
+  int numMeshSources;
+  real* lightRadii; // per light, distance beyond which it is never shaded, set by bound_lights()
+  void* cacheMapping; // compiled scene file the arrays point into, NULL if they were allocated
+  size_t cacheLength;
+} Scene;
+
+// Structure to hold the header of a compiled scene file
+// The arrays of a Scene follow it, each at offsets[i] from the start of the
+// file, so a mapped file can be rendered from without any parsing.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t realSize; // sizeof(real), so a build of the other precision rejects the file
+  uint32_t surfaceSize; // record sizes, so layout changes reject the file
+  uint32_t lightSize;
+  uint32_t nodeSize;
+  uint32_t meshNodeSize;
+  uint32_t meshSourceSize;
+  int32_t numSurfaces;
+  int32_t numLights;
+  int32_t numBVHNodes;
+  int32_t numPlanes;
+  int32_t numSpheres;
+  int32_t numVertices;
+  int32_t numTriangles;
+  int32_t numMeshNodes;
+  int32_t numMeshSources;
+  double cameraPosition[3]; // double in both precisions, so the header never changes layout
+  double cameraWidth;
+  double cameraHeight;
+  uint64_t sourceSize; // size, modification time and hash of the json it was compiled from
+  int64_t sourceModified;
+  uint64_t sourceHash;
+  uint64_t checksum; // hash of everything after the header
+  uint64_t offsets[sceneCacheSections];
+  uint64_t lengths[sceneCacheSections];
+  char sourcePath[1024]; // absolute path of the json it was compiled from
+} SceneCacheHeader;
+
+// Animation track targets
+#define trackCamera 0 // keyframes are camera positions
+#define trackSurface 1 // keyframes translate a plane or sphere
+#define trackLight 2 // keyframes translate a light
+
+// Structure to hold one keyframe of an animation track
+typedef struct {
+  int frame;
+  real value[3];
+} Keyframe;
+
+// Structure to hold the keyframes of one animated property, sorted by frame
+// Values between keyframes are interpolated linearly and held before the
+// first and after the last
+typedef struct {
+  int target; // trackCamera, trackSurface or trackLight
+  int index; // index of the surface or light
+  int slot; // position of the surface in the kernel arrays
+  real base[3]; // position as loaded, translations are added to it
+  Keyframe* keys;
+  int numKeys;
+  int capacity;
+} Track;
+
+// Structure to hold the counters of a render
+// Each render thread counts into its own copy, which free_context() adds to
+// renderStats, so counting costs no locks or atomics
+typedef struct {
+  uint64_t primaryRays; // rays from the camera, antialiasing samples included
+  uint64_t shadowRays;
+  uint64_t shadowBlocked; // shadow rays that hit something before reaching the light
+  uint64_t occluderHits; // shadow rays blocked by the cached occluder, without a traversal
+  uint64_t primitiveTests; // ray-sphere, ray-plane and ray-triangle intersection tests
+  uint64_t boxTests; // ray-box tests while walking the BVH
+  uint64_t litPixels; // pixels whose center ray hit an object
+  uint64_t backgroundPixels; // pixels whose center ray hit nothing
+  uint64_t refinedPixels; // pixels antialias() supersampled
+  uint64_t packets; // packets of primary rays traced together through the BVH
+  uint64_t splitPackets; // packets whose rays diverged and were traced one at a time
+  uint64_t culledLights; // lights skipped while shading a point, out of range or outside their cone
+} RenderStats;
+
+// Structure to hold the state private to one render thread
+typedef struct {
+  Scene* scene; // the scene being rendered
+  int* lastOccluder; // per light, index of the object that last blocked it or -1
+  RenderStats stats; // counters of this thread
+  int* tileLights; // indices of the lights that can reach the current tile, in order
+  int numTileLights;
+  int* lightRuns; // where in tileLights each run of lights of one class ends
+  int numLightRuns;
+} RenderContext;
+
+// Structure to hold a packet of primary rays, which all start at the camera
+// The rays walk the BVH together, each keeping its own nearest hit
+typedef struct {
+  int count;
+  real origin[3];
+  real direction[maxPacketSize * maxPacketSize][3];
+  real invDirection[maxPacketSize * maxPacketSize][3];
+  real invLow[3]; // smallest and largest inverse direction on each axis,
+  real invHigh[3]; // of one sign on every axis unless the packet diverges
+  real closestT[maxPacketSize * maxPacketSize];
+  int closest[maxPacketSize * maxPacketSize]; // index of the nearest object hit or -1
+  size_t pixIndex[maxPacketSize * maxPacketSize]; // position of each ray's pixel in pixmap
+} RayPacket;
+
+// Work done on a tile by the render threads
+typedef void (*TileFunction)(Tile tile, RenderContext* context);
+
+// Structure to hold one render thread's deque of tile indices, [head, tail).
+// The owner pops from the head, idle threads steal from the tail.
+typedef struct {
+  pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+} TileQueue;
+
+// Structure to hold a scene loaded by the render daemon, named by the hash of its json
+typedef struct {
+  char id[17]; // 16 hex digits, empty for a free slot
+  char key[17]; // hash of the json and directory it was uploaded with, empty once its OBJ files changed
+  Scene scene;
+  unsigned long lastUsed; // daemonClock when it was last asked for
+  int users; // requests using the scene, which keep it from being evicted
+  int loading; // boolean, load_slot() is filling it without sceneLock, lookups pass it by
+} CachedScene;
+
+// Structure to hold the point a pixel's center ray hit, which --watch keeps
+// so edits of the lights can shade the pixel again without tracing it
+typedef struct {
+  real position[3];
+  real normal[3]; // unit normal of the surface there
+} VisiblePoint;
+
+// Structure to hold a sphere --watch found changed between two versions of the scene
+typedef struct {
+  int index; // surface index, the same in both versions
+  int oldSlot; // position in the kernel arrays of the scene as rendered
+  int newSlot; // and of the edited scene
+} SphereEdit;
+
 // Global variables to hold image data
 RGBpixel* pixmap; // array of pixels to hold the image data
-int numPixels; // total number of pixels in image (N * M)
-int M; // height of image in pixels
-int N; // width of image in pixels
+size_t numPixels; // total number of pixels in image (N * M)
+size_t M; // height of image in pixels
+size_t N; // width of image in pixels
+size_t pixmapFirstRow = 0; // image row held at the start of pixmap, nonzero while streaming bands
+size_t imageWidth; // size in pixels of the whole frame, N and M unless a region is rendered
+size_t imageHeight;
+int useRegion = 0; // boolean, --region renders only part of the frame
+size_t region[4]; // x0, y0, x1, y1 of the part of the frame --region renders, x1 and y1 excluded
+size_t bufferLeft = 0; // frame column and row of the first pixel of pixmap, with --region
+size_t bufferTop = 0;
+int cameraSet = 0; // boolean, --camera replaces the position of the scene's camera
+real cameraOverride[3];
+int streamOutput = 0; // boolean to render in bands straight into the output file
+size_t streamRows = 0; // rows per band when streaming, 0 picks a band size
+char outputFormat = 0; // '3' or '6', 0 picks the format from the output file name
+char* statsName = NULL; // file --stats writes the counters and timings to, - for stdout
+size_t progressiveStep = 0; // lattice spacing of the first progressive pass, 0 renders in one pass
+size_t passStep = 1; // raycast() traces the pixels whose x and y are multiples of this
+size_t tracedStep = 0; // lattice an earlier pass traced and raycast() skips, 0 for none
+double lightCutoff = 0; // color levels all the lights skipped at a point may add up to, 0 shades every light
+int packetSize = 4; // width and height of the pixel blocks traced as ray packets, 0 traces single rays
+double aaThreshold = -1; // color difference between neighbors that antialias() refines, < 0 turns it off
+int* hitBuffer = NULL; // index of the object hit at each pixel, or -1, kept while antialiasing or watching
+VisiblePoint* visibility = NULL; // point each pixel's center ray hit, kept while watching
+unsigned char* aaMask = NULL; // boolean per pixel, set where antialias() supersamples
+size_t aaPixels = 0; // pixels antialias() has looked at
 
 // Global variables to hold general scene data
-Object physicalObjects[maxObjects]; // Global array to keep track of objects in the scene
+Object* physicalObjects; // Global array to keep track of objects in the scene
 int numPhysicalObjects; // index to keep track of number of objects in the scene
-Object lightObjects[maxObjects];
+int physicalCapacity; // number of objects physicalObjects has room for
+Object* lightObjects;
 int numLightObjects;
+int lightCapacity;
 Object cameraObject;
+float* meshVertices; // vertices of every mesh read so far, compile_scene() hands them to the scene
+int numMeshVertices;
+int vertexCapacity;
+MeshTriangle* meshTriangles; // triangles of every mesh read so far
+int numMeshTriangles;
+int triangleCapacity;
+MeshSource* meshSources; // OBJ files read so far, each once
+int numMeshSources;
+int sourceCapacity;
+char* meshDirectory = NULL; // --mesh-dir, where relative mesh file names are found, NULL for next to the json, empty to refuse them
+
+// Global variables to hold the acceleration structures
+int useBVH = 1; // boolean to trace rays through the BVH instead of a linear scan
+Scene compiledScene; // the scene read_scene() parsed, compiled for rendering
+char* kernelName = NULL; // kernel requested on the command line, NULL picks the best available
+SphereKernel sphereKernel; // kernels picked by select_kernels()
+PlaneKernel planeKernel;
+int bvhSortAxis; // axis the spheres are being sorted along while building the BVH
+Surface* bvhSortSurfaces; // surfaces of the scene whose BVH is being built
+
+// Global variables to hold render thread data
+int numThreads = 1; // number of threads used to render the image
+Tile* tiles; // array of tiles covering the image
+size_t numTiles;
+size_t tileCapacity; // number of tiles the tiles array has room for
+TileQueue* tileQueues; // one queue of tiles per render thread
+TileFunction tileFunction; // what the render threads do with each tile
+pthread_t* poolThreads = NULL; // render threads, started by the first render_tiles() that needs them
+int* poolIds; // worker index of each render thread
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER; // guards the pool variables below
+pthread_cond_t poolStart = PTHREAD_COND_INITIALIZER; // signaled when a batch of tiles is ready
+pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER; // signaled when the last thread finishes a batch
+unsigned long poolBatch = 0; // number of batches render_tiles() has handed out
+int poolRunning = 0; // render threads still working on the current batch
+int poolExit = 0; // boolean, tells the render threads to return
+RenderStats renderStats; // counters of every finished render thread
+pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER; // guards renderStats
+double loadSeconds = 0; // wall time spent in each phase, for --stats
+double raycastSeconds = 0;
+double writeSeconds = 0;
+
+#ifdef ALLOC_STATS
+// Global variables to count the heap allocations made by the render threads
+__thread int countAllocations = 0; // boolean, set while this thread renders pixels
+long renderAllocations = 0; // allocations made while countAllocations was set
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+void report_allocations();
+#endif
+
+// Global variables to hold the animation
+char* animationName = NULL; // keyframe file given with --animate
+Track* tracks; // animated properties read by read_animation()
+int numTracks;
+int numFrames; // one more than the last keyframe
+
+// Global variables to hold the render daemon
+char* daemonName = NULL; // socket --daemon listens on
+char* connectName = NULL; // socket --connect sends the render to
+char sceneDirectory[PATH_MAX]; // where the daemon keeps the json and compiled file of each scene
+CachedScene daemonCache[daemonScenes];
+unsigned long daemonClock = 0; // counts scene lookups, for least recently used eviction
+pthread_mutex_t sceneLock = PTHREAD_MUTEX_INITIALIZER; // guards daemonCache and daemonClock
+pthread_mutex_t compileLock = PTHREAD_MUTEX_INITIALIZER; // one scene compiles at a time
+pthread_mutex_t renderLock = PTHREAD_MUTEX_INITIALIZER; // one job at a time owns pixmap, N, M and the pool
+
+// Global variables to hold the incremental re-render of --watch
+int watchScene = 0; // boolean, keep the image up to date with the scene file
+Scene editedScene; // the new version of the scene, while the pixels it changes are found
+SphereEdit sphereEdits[watchMaxEdits]; // spheres that differ between compiledScene and editedScene
+int numSphereEdits;
+unsigned char* dirtyMask = NULL; // boolean per pixel, set where an edit may change the color
 
 // Miscellaneous Globals
 int line = 1; // keep track of the line number inside of the json file
+char* objName = NULL; // OBJ file read_obj() is reading, which number errors name, NULL for the json
 
 // function prototype declarations
-void expect_c(FILE* json, int d);
-int next_c(FILE* json);
-double next_number(FILE* json);
-char* next_string(FILE* json);
-void next_vector(FILE* json, double* v);
-double plane_intersection(double* Ro, double* Rd, double* P, double* N);
+void expect_c(JsonInput* json, int d);
+int next_c(JsonInput* json);
+double next_number(JsonInput* json);
+void number_error(char* message);
+Token next_string(JsonInput* json);
+int token_equal(Token token, char* s);
+void next_vector(JsonInput* json, real* v);
+real plane_intersection(real* Ro, real* Rd, real* P, real* N);
 void raycast();
+void raycast_band(size_t firstRow, size_t endRow);
+void raycast_tile(Tile tile, RenderContext* context);
+void render_tiles(size_t firstRow, size_t endRow, TileFunction function);
+int trace_sample(real px, real py, RenderContext* context, real* color, VisiblePoint* hit);
+void primary_ray(Scene* scene, real px, real py, real* Ro, real* Rd);
+void shade_hit(real t, int index, real* Ro, real* Rd, RenderContext* context, real* color, VisiblePoint* hit);
+void store_pixel(size_t pixIndex, real* color, int index, VisiblePoint* hit, RenderContext* context);
+void trace_packet(RayPacket* packet, RenderContext* context);
+void bound_lights(Scene* scene);
+int light_bounded(Light* light);
+void cull_lights(real x0, real y0, real x1, real y1, RenderContext* context);
+int packet_nearest_hit(RenderContext* context, RayPacket* packet);
+int packet_box(RayPacket* packet, real* min, real* max, real maxT, real* tNear);
+void antialias();
+void mark_edges(Tile tile, RenderContext* context);
+void supersample_tile(Tile tile, RenderContext* context);
+void report_antialiasing();
+void init_context(RenderContext* context, Scene* scene);
+void free_context(RenderContext* context);
+void* render_worker(void* arg);
+void start_pool();
+void stop_pool();
+int next_tile(int worker, size_t* tile);
+void render_streaming(char* filename);
+void map_json(char* filename, JsonInput* json);
+void read_animation(char* filename, Scene* scene);
+Track* find_track(Scene* scene, int target, int index);
+void track_value(Track* track, int frame, real* value);
+void animate_frame(Scene* scene, int frame);
+void refit_bvh(Scene* scene);
+void render_animation(char* pattern);
+void render_progressive(char* filename, size_t step);
+int frame_filename(char* pattern, int frame, char* name, size_t size);
+size_t parse_dimension(char* text, char* name);
+double seconds_now();
+void write_stats(char* filename, char* sceneName);
+void compile_scene(Scene* scene);
+void free_scene(Scene* scene);
+void build_bvh(Scene* scene);
+void build_bvh_node(Scene* scene, int node, int first, int count);
+real nearest_hit(RenderContext* context, real* Ro, real* Rd, int* hitIndex);
+int shadow_hit(RenderContext* context, real* Ro, real* Rd, real maxT, int skipIndex, int* occluder);
+void build_kernel_arrays(Scene* scene);
+void build_mesh_bvh(Scene* scene);
+void build_mesh_node(Scene* scene, float* centroids, int node, int first, int count, int depth);
+float box_area(float* min, float* max);
+void bound_triangle(Scene* scene, int i, float* min, float* max);
+int mesh_box(real* Ro, real* invRd, MeshNode* node, real maxT, real* tNear);
+void mesh_nearest_hit(RenderContext* context, real* Ro, real* Rd, real* closestT, int* closest);
+int mesh_shadow_hit(RenderContext* context, real* Ro, real* Rd, real maxT, int skipIndex);
+void select_kernels();
+void sphere_intersection_scalar(real* Ro, real* Rd, SphereArrays* spheres, int first, int count, real* t);
+void plane_intersection_scalar(real* Ro, real* Rd, PlaneArrays* planes, int first, int count, real* t);
+#ifdef X86_KERNELS
+void sphere_intersection_sse2(real* Ro, real* Rd, SphereArrays* spheres, int first, int count, real* t);
+void plane_intersection_sse2(real* Ro, real* Rd, PlaneArrays* planes, int first, int count, real* t);
+void sphere_intersection_avx2(real* Ro, real* Rd, SphereArrays* spheres, int first, int count, real* t);
+void plane_intersection_avx2(real* Ro, real* Rd, PlaneArrays* planes, int first, int count, real* t);
+#endif
+void bench_kernels(int count);
+real surface_intersection(Surface* surface, real* Ro, real* Rd);
+real triangle_intersection(real* Ro, real* Rd, float* v0, float* v1, float* v2);
+real mesh_intersection(Scene* scene, int i, real* Ro, real* Rd);
+real primitive_intersection(Scene* scene, int index, real* Ro, real* Rd);
+Surface* hit_surface(Scene* scene, int index);
+int compare_centroids(const void* a, const void* b);
+int ray_box(real* Ro, real* invRd, real* min, real* max, real maxT, real* tNear);
 void read_scene(char* filename);
-void skip_ws(FILE* json);
-double sphere_intersection(double* Ro, double* Rd, double* C, double r);
+void read_obj(char* filename, Object* obj, int surface);
+void skip_blanks(JsonInput* json);
+uint32_t obj_index(JsonInput* json, int firstVertex, char* filename);
+void record_mesh_source(char* filename, JsonInput* json);
+void* reserve_array(void* array, int count, int* capacity, size_t size, char* filename);
+void bench_load(char* filename, int runs);
+void load_scene(char* filename, Scene* scene);
+void write_scene_cache(char* jsonName, char* cacheName, Scene* scene);
+int load_scene_cache(char* cacheName, Scene* scene);
+void scene_sections(Scene* scene, void** sections[], size_t lengths[]);
+int mesh_sources_current(Scene* scene);
+uint64_t hash_bytes(uint64_t hash, void* data, size_t length);
+uint64_t hash_file(char* filename, uint64_t* size, int64_t* modified);
+Object* reserve_object(Object* objects, int count, int* capacity);
+Object* shrink_objects(Object* objects, int count, int* capacity);
+void skip_ws(JsonInput* json);
+real sphere_intersection(real* Ro, real* Rd, real* C, real r);
 void writeP3(FILE* fh);
+void writeP6(FILE* fh);
+char format_from_filename(char* filename);
+RGBpixel* read_ppm(char* filename, size_t* width, size_t* height, size_t* placement);
+int ppm_header(char* buffer, char magic);
+int parse_region(char* text, size_t width, size_t height);
+void setup_region();
+int parse_camera(char* text, real* position);
+int run_daemon(char* socketName);
+void* serve_client(void* arg);
+int daemon_scene(int fd, FILE* in, char* request);
+void daemon_render(int fd, char* request);
+CachedScene* find_scene(char* id);
+CachedScene* find_upload(char* key);
+CachedScene* load_slot(char* name, char* meshDir);
+void drop_slot(CachedScene* cached);
+void release_scene(CachedScene* cached);
+int unix_address(char* socketName, struct sockaddr_un* address);
+void reply_error(int fd, char* message);
+int send_bytes(int fd, void* data, size_t length);
+int connect_socket(char* socketName);
+int request_render(char* socketName, char* sceneName, char* outputName, char* regionText);
+int compile_child(char* jsonName, char* cacheName, char* meshDir);
+void replace_image(char* tempName, char* filename);
+void watch_scene(char* sceneName, char* outputName);
+uint64_t mesh_sources_stamp(Scene* scene, int recorded);
+size_t update_image(Scene* edited, int* relit);
+int scene_edits(Scene* old, Scene* edited, int* relight);
+int sphere_slot(Scene* scene, int index);
+void mark_dirty(Tile tile, RenderContext* context);
+int edits_block(Scene* scene, real* Ro, real* Rd, real maxT);
+real edit_intersection(Scene* scene, int index, int slot, real* Ro, real* Rd);
+void relight_tile(Tile tile, RenderContext* context);
+void retrace_tile(Tile tile, RenderContext* context);
+void crop_region();
+int merge_regions(char* filename, int numParts, char** parts);
+int compare_images(char* first, char* second);
 void printObjs();
 void printPixMap();
-unsigned char double_to_color(double color);
-void illuminate(double colorObjT, Object colorObj, double* Rd, double* Ro, int pixIndex);
-double frad(double lightDistance, double a0, double a1, double a2);
+unsigned char double_to_color(real color);
+void surface_point(Scene* scene, real colorObjT, int colorIndex, real* Ro, real* Rd, real* objOrigin, real* surfaceNormal);
+void illuminate(int colorIndex, real* objOrigin, real* surfaceNormal, real* color, RenderContext* context);
+void shade_point_lights(int first, int end, int colorIndex, real* objOrigin, real* surfaceNormal, real* objToCam, real* color, RenderContext* context);
+void shade_attenuated_lights(int first, int end, int colorIndex, real* objOrigin, real* surfaceNormal, real* objToCam, real* color, RenderContext* context);
+void shade_spot_lights(int first, int end, int colorIndex, real* objOrigin, real* surfaceNormal, real* objToCam, real* color, RenderContext* context);
+void shade_attenuated_spot_lights(int first, int end, int colorIndex, real* objOrigin, real* surfaceNormal, real* objToCam, real* color, RenderContext* context);
+void group_lights(RenderContext* context);
+real frad(real lightDistance, real a0, real a1, real a2);
 void clean_up();
-double diffuse_reflection(double lightColor, double diffuseColor, double diffuseFactor);
-double specular_reflection(double lightColor, double specularColor, double diffuseFactor, double specularFactor);
-int obj_compare(Object a, Object b);
-double fang(double angularA0, double theta, double* lightToObj, double* lightDirection);
+real diffuse_reflection(real lightColor, real diffuseColor, real diffuseFactor);
+real specular_reflection(real lightColor, real specularColor, real diffuseFactor, real specularFactor);
+real fang(real angularA0, real cosTheta, real* lightToObj, real* lightDirection);
 
 // static inline functions
 // returns 1 if values are equal, 0 if not
-static inline int equal(double a, double b) {
+static inline int equal(real a, real b) {
   return fabs(a - b) < epsilon;
 }
-static inline double sqr(double v) {
+// v to the power specularPower, by repeated squaring so the constant
+// exponent unrolls into a few multiplications instead of a pow() call
+// The products are kept in double, so a float build rounds only the result,
+// as powf() does, and renders the same image
+static inline real specular_power(real v) {
+  double base = v;
+  double result = 1;
+  for (int exponent = specularPower; exponent > 0; exponent >>= 1) {
+    if (exponent & 1) result *= base;
+    base *= base;
+  }
+  return (real)result;
+}
+
+static inline real sqr(real v) {
   return v*v;
 }
-static inline void normalize(double* v) {
-  double len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
+static inline void normalize(real* v) {
+  real len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
   if (!equal(len, 0.0)) {
     v[0] /= len;
     v[1] /= len;
     v[2] /= len;
   }
 }
-static inline void v3_scale(double* a, double s, double* c) {
+static inline void v3_scale(real* a, real s, real* c) {
   c[0] = s * a[0];
   c[1] = s * a[1];
   c[2] = s * a[2];
 }
-static inline void v3_add(double* a, double* b, double* c) {
+static inline void v3_add(real* a, real* b, real* c) {
   c[0] = a[0] + b[0];
   c[1] = a[1] + b[1];
   c[2] = a[2] + b[2];
 }
-static inline void v3_subtract(double* a, double* b, double* c) {
+static inline void v3_subtract(real* a, real* b, real* c) {
   c[0] = a[0] - b[0];
   c[1] = a[1] - b[1];
   c[2] = a[2] - b[2];
 }
-static inline double p3_distance(double* a, double* b) {
+static inline real p3_distance(real* a, real* b) {
   return sqrt(sqr(b[0] - a[0]) + sqr(b[1] - a[1]) + sqr(b[2] - a[2]));
 }
-static inline double v3_dot(double* a, double* b) {
+static inline real v3_dot(real* a, real* b) {
   return (a[0] * b[0]) + (a[1] * b[1]) + (a[2] * b[2]);
 }
-static inline double rad_to_deg(double radians) {
+static inline void v3_cross(real* a, real* b, real* c) {
+  c[0] = a[1] * b[2] - a[2] * b[1];
+  c[1] = a[2] * b[0] - a[0] * b[2];
+  c[2] = a[0] * b[1] - a[1] * b[0];
+}
+static inline real rad_to_deg(real radians) {
     return radians * (180.0 / M_PI);
 }
@@ -0,0 +1,150 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generates a random scene in the raycast JSON format, for benchmarking
+// Usage: scenegen spheres planes pointLights spotLights [seed [falloff]] > scene.json
+// The same arguments and seed always give the same scene. falloff is the
+// radial-a2 of every light, larger values give lights a shorter reach.
+// Usage: scenegen --mesh rings > mesh.obj
+// Writes a bumpy torus as a Wavefront OBJ file instead, rings around by
+// rings / 2 across, in 2 * rings * (rings / 2) triangles.
+
+// returns a random double in [lo, hi)
+double random_range(double lo, double hi) {
+  return lo + (hi - lo) * (rand() / (RAND_MAX + 1.0));
+}
+
+// stores a random unit vector in v
+void random_direction(double* v) {
+  double length;
+  do { // pick points in the cube until one lies inside the unit ball
+    v[0] = random_range(-1, 1);
+    v[1] = random_range(-1, 1);
+    v[2] = random_range(-1, 1);
+    length = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+  } while (length > 1 || length < 1e-3);
+  v[0] /= length;
+  v[1] /= length;
+  v[2] /= length;
+}
+
+// parses a count argument, exiting on anything but a non negative number
+int parse_count(char* text, char* name) {
+  char* end;
+  long value = strtol(text, &end, 10);
+  if (*end != 0 || value < 0 || value > 100000000) {
+    fprintf(stderr, "Error: Invalid number of %s, \"%s\".\n", name, text);
+    exit(1);
+  }
+  return (int)value;
+}
+
+double falloff = 0.001; // radial-a2 of the lights
+
+void print_light(int spot) {
+  printf(",\n  {\n    \"type\": \"light\",\n");
+  printf("    \"color\": [%.3f, %.3f, %.3f],\n", random_range(0.2, 1), random_range(0.2, 1), random_range(0.2, 1));
+  double position[3] = {random_range(-40, 40), random_range(-20, 40), random_range(0, 60)};
+  printf("    \"position\": [%.4f, %.4f, %.4f],\n", position[0], position[1], position[2]);
+  if (spot) { // aimed at a random point among the spheres
+    double target[3] = {random_range(-40, 40), random_range(-20, 40), random_range(40, 160)};
+    printf("    \"direction\": [%.4f, %.4f, %.4f],\n",
+      target[0] - position[0], target[1] - position[1], target[2] - position[2]);
+    printf("    \"theta\": %.2f,\n    \"angular-a0\": %.2f,\n", random_range(10, 45), random_range(0.5, 4));
+  }
+  printf("    \"radial-a0\": 0.5,\n    \"radial-a1\": 0.01,\n    \"radial-a2\": %g\n  }", falloff);
+}
+
+// prints a bumpy torus of major radius 10 and minor radius about 4, around
+// the z axis tipped 30 degrees towards y, as an OBJ file of rings by sides
+// quads split in two
+void print_torus(int rings, int sides) {
+  printf("# bumpy torus, %d vertices, %d triangles\n", rings * sides, 2 * rings * sides);
+  for (int i = 0; i < rings; i++) {
+    double u = 2 * M_PI * i / rings;
+    for (int j = 0; j < sides; j++) {
+      double v = 2 * M_PI * j / sides;
+      double r = 4 * (1 + 0.1 * sin(7 * u) * sin(5 * v));
+      double x = (10 + r * cos(v)) * cos(u);
+      double y = (10 + r * cos(v)) * sin(u);
+      double z = r * sin(v);
+      printf("v %.5f %.5f %.5f\n", x, y * cos(M_PI / 6) - z * sin(M_PI / 6), y * sin(M_PI / 6) + z * cos(M_PI / 6));
+    }
+  }
+  for (int i = 0; i < rings; i++) {
+    for (int j = 0; j < sides; j++) { // vertices count from 1
+      int a = i * sides + j + 1;
+      int b = i * sides + (j + 1) % sides + 1;
+      int c = (i + 1) % rings * sides + j + 1;
+      int d = (i + 1) % rings * sides + (j + 1) % sides + 1;
+      printf("f %d %d %d\nf %d %d %d\n", a, c, d, a, d, b);
+    }
+  }
+}
+
+int main(int args, char** argv) {
+  if (args == 3 && strcmp(argv[1], "--mesh") == 0) {
+    int rings = parse_count(argv[2], "rings");
+    if (rings < 3 || rings > 30000) {
+      fprintf(stderr, "Error: A mesh needs 3 to 30000 rings, \"%s\".\n", argv[2]);
+      exit(1);
+    }
+    print_torus(rings, rings / 2 < 3 ? 3 : rings / 2);
+    return 0;
+  }
+  if (args < 5 || args > 7) {
+    fprintf(stderr, "Usage: scenegen spheres planes pointLights spotLights [seed [falloff]] > scene.json\n");
+    fprintf(stderr, "       scenegen --mesh rings > mesh.obj\n");
+    exit(1);
+  }
+  int numSpheres = parse_count(argv[1], "spheres");
+  int numPlanes = parse_count(argv[2], "planes");
+  int numPoints = parse_count(argv[3], "point lights");
+  int numSpots = parse_count(argv[4], "spot lights");
+  srand(args >= 6 ? atoi(argv[5]) : 1);
+  if (args == 7) {
+    char* end;
+    falloff = strtod(argv[6], &end);
+    if (*end != 0 || !(falloff >= 0)) {
+      fprintf(stderr, "Error: Invalid falloff, \"%s\".\n", argv[6]);
+      exit(1);
+    }
+  }
+
+  printf("[\n");
+  printf("  {\n    \"type\": \"camera\",\n    \"width\": 0.5,\n    \"height\": 0.5\n  }");
+  for (int i = 0; i < numPoints; i++) {
+    print_light(0);
+  }
+  for (int i = 0; i < numSpots; i++) {
+    print_light(1);
+  }
+  for (int i = 0; i < numPlanes; i++) {
+    printf(",\n  {\n    \"type\": \"plane\",\n");
+    printf("    \"diffuse_color\": [%.3f, %.3f, %.3f],\n", random_range(0.2, 0.8), random_range(0.2, 0.8), random_range(0.2, 0.8));
+    printf("    \"specular_color\": [1.0, 1.0, 1.0],\n");
+    if (i == 0) { // a floor under everything
+      printf("    \"position\": [0, -20, 0],\n    \"normal\": [0, 1, 0]\n  }");
+      continue;
+    }
+    // a wall facing the middle of the spheres, far enough away that the
+    // camera at the origin is always on its front side
+    double normal[3];
+    random_direction(normal);
+    double distance = random_range(110, 160);
+    printf("    \"position\": [%.4f, %.4f, %.4f],\n",
+      -normal[0] * distance, 10 - normal[1] * distance, 100 - normal[2] * distance);
+    printf("    \"normal\": [%.4f, %.4f, %.4f]\n  }", normal[0], normal[1], normal[2]);
+  }
+  for (int i = 0; i < numSpheres; i++) {
+    printf(",\n  {\n    \"type\": \"sphere\",\n");
+    printf("    \"diffuse_color\": [%.3f, %.3f, %.3f],\n", random_range(0, 1), random_range(0, 1), random_range(0, 1));
+    printf("    \"specular_color\": [1.0, 1.0, 1.0],\n");
+    printf("    \"position\": [%.4f, %.4f, %.4f],\n", random_range(-40, 40), random_range(-20, 40), random_range(40, 160));
+    printf("    \"radius\": %.4f\n  }", random_range(0.1, 2));
+  }
+  printf("\n]\n");
+  return 0;
+}